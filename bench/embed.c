@@ -0,0 +1,90 @@
+//Embedding benchmark: one small evaluation through the C API against
+//starting a process for it, the way jobs ran before libnisp. Build
+//libnisp.a and nisp with compile.scr, then from the nisp directory
+//
+//    gcc -std=c99 -O2 -I. bench/embed.c libnisp.a -lm -lpthread -o embed && ./embed
+//
+//Both run the expression against stdlib.nsp. The embedded context loads
+//it once, and is timed with and without a reset to it after every call.
+//Every process loads it again.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "nisp.h"
+
+#define EXPR "len {1 2 3 4 5}"
+#define EVALS 100000
+#define PROCESSES 200
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+int main(void)
+{
+    lctx* c=nisp_new();
+    lval_del(nisp_load(c, "stdlib.nsp"));
+    nisp_snapshot(c);
+    double t=now();
+    for(int i=0; i<EVALS; i++)
+    {
+        lval_del(nisp_eval(c, EXPR));
+    }
+    double eval=(now()-t)/EVALS;
+    t=now();
+    for(int i=0; i<EVALS; i++)
+    {
+        lval_del(nisp_eval(c, EXPR));
+        nisp_reset(c);
+    }
+    double embedded=(now()-t)/EVALS;
+    nisp_del(c);
+
+    char path[]="/tmp/nisp_benchXXXXXX";
+    int fd=mkstemp(path);
+    FILE* f=fd<0 ? NULL : fdopen(fd, "w");
+    if(!f)
+    {
+        perror(path);
+        return 1;
+    }
+    fprintf(f, "(print (%s))\n", EXPR);
+    fclose(f);
+    char* nisp=getenv("NISP") ? getenv("NISP") : "./nisp";
+    t=now();
+    for(int i=0; i<PROCESSES; i++)
+    {
+        pid_t pid=fork();
+        if(pid==0)
+        {
+            if(!freopen("/dev/null", "w", stdout))
+            {
+                _exit(126);
+            }
+            execl(nisp, nisp, "stdlib.nsp", path, (char*) NULL);
+            _exit(127);
+        }
+        int status;
+        if(pid<0 || waitpid(pid, &status, 0)<0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0)
+        {
+            fprintf(stderr, "Could not run %s\n", nisp);
+            unlink(path);
+            return 1;
+        }
+    }
+    double forked=(now()-t)/PROCESSES;
+    unlink(path);
+
+    printf("embedded nisp_eval:                %8.1fus per call\n", eval*1e6);
+    printf("embedded nisp_eval and nisp_reset: %8.1fus per call\n", embedded*1e6);
+    printf("fork/exec %-24s %8.1fus per call\n", nisp, forked*1e6);
+    printf("embedded with a reset is %.0fx faster\n", forked/embedded);
+    return 0;
+}
@@ -0,0 +1,129 @@
+//String search benchmark: GB/s scanned by each substring search the string
+//builtins can use, counting the matches of a few needles in a log of MB
+//megabytes (default 400) held in memory. Build libnisp.a and nisp with
+//compile.scr, then from the nisp directory
+//
+//    gcc -std=c99 -O2 -I. bench/strscan.c libnisp.a -lm -lpthread -o strscan && ./strscan [MB]
+//
+//Each count is the way str-count walks a string, best of 5. lstr_find is
+//what the builtins call; it picks AVX2 where the machine has it, SSE2
+//otherwise, and memchr for single bytes. Every search has to find the
+//same number of matches.
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nisp.h"
+
+typedef const char*(*lstr_finder)(const char*, size_t, const char*, size_t);
+
+//Not part of the API, but exported by libnisp
+const char* lstr_find(const char* h, size_t hn, const char* n, size_t nn);
+const char* lstr_find_scalar(const char* h, size_t hn, const char* n, size_t nn);
+#if defined(__x86_64__) && defined(__GNUC__)
+const char* lstr_find_sse2(const char* h, size_t hn, const char* n, size_t nn);
+const char* lstr_find_avx2(const char* h, size_t hn, const char* n, size_t nn);
+#endif
+
+#define RUNS 5
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+static long count(lstr_finder find, const char* h, size_t hn, const char* n, size_t nn)
+{
+    long k=0;
+    for(const char* p=h; (p=find(p, hn-(p-h), n, nn)); p+=nn)
+    {
+        k++;
+    }
+    return k;
+}
+
+//GB/s of the best run, and the matches it found
+static double rate(lstr_finder find, const char* h, size_t hn, const char* n, long* found)
+{
+    double best=0;
+    for(int i=0; i<RUNS; i++)
+    {
+        double t=now();
+        *found=count(find, h, hn, n, strlen(n));
+        t=now()-t;
+        if(best==0 || t<best)
+        {
+            best=t;
+        }
+    }
+    return hn/best/1e9;
+}
+
+int main(int argc, char** argv)
+{
+    size_t size=(argc>1 ? atol(argv[1]) : 400)*1024*1024;
+    char* log=malloc(size+256);
+    size_t len=0;
+    for(unsigned i=0; len<size; i++)
+    {
+        len+=sprintf(log+len, "2026-10-19T12:%02u:%02u.%03u %s request_id=%08x handled in %u ms\n",
+            i/60000%60, i/1000%60, i%1000, i%50==0 ? "ERROR" : "INFO", i%9973==0 ? 0xdeadbeef : i*2654435761u, i%997);
+    }
+
+    const char* needles[]={"ERROR", "request_id=deadbeef", "no such line in the log", "\n"};
+    struct { const char* name; lstr_finder find; } paths[]=
+    {
+        {"scalar", lstr_find_scalar},
+#if defined(__x86_64__) && defined(__GNUC__)
+        {"SSE2", lstr_find_sse2},
+        {"AVX2", lstr_find_avx2},
+#endif
+        {"lstr_find", lstr_find},
+    };
+    int npaths=sizeof(paths)/sizeof(paths[0]);
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    int avx2=__builtin_cpu_supports("avx2");
+#endif
+
+    printf("GB/s scanned in a %zuMB log\n%-26s", len/1024/1024, "needle");
+    for(int j=0; j<npaths; j++)
+    {
+        printf("%10s", paths[j].name);
+    }
+    printf("   matches\n");
+    for(int i=0; i<4; i++)
+    {
+        const char* n=needles[i];
+        printf("%-26s", n[0]=='\n' ? "\"\\n\"" : n);
+        long expect=-1;
+        for(int j=0; j<npaths; j++)
+        {
+#if defined(__x86_64__) && defined(__GNUC__)
+            if(paths[j].find==lstr_find_avx2 && !avx2)
+            {
+                printf("%10s", "-");
+                continue;
+            }
+#endif
+            long found;
+            printf("%10.2f", rate(paths[j].find, log, len, n, &found));
+            if(expect>=0 && found!=expect)
+            {
+                printf("\n%s found %ld, not %ld!\n", paths[j].name, found, expect);
+                return 1;
+            }
+            expect=found;
+        }
+        printf("%10ld\n", expect);
+    }
+    double t=now();
+    size_t n=strlen(log);
+    printf("strlen on the same log: %.2f GB/s\n", n/(now()-t)/1e9);
+    free(log);
+    return 0;
+}
@@ -1,28 +1,38 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 #include "mpc/mpc.h"
+#include "nisp.h"
 
 #define BUF_SIZE 2048
 #define TRUE 1
 #define FALSE 0
 
-#define LASSERT(args, cond, fmt, ...)\
+#define LASSERT_CODE(args, cond, code, fmt, ...)\
     if(!(cond))\
     {\
-        lval* err=lval_err(fmt, ##__VA_ARGS__);\
+        lval* err=lval_errc(code, fmt, ##__VA_ARGS__);\
         lval_del(args);\
         return err;\
     }
 
+#define LASSERT(args, cond, fmt, ...)\
+    LASSERT_CODE(args, cond, LERR_ERROR, fmt, ##__VA_ARGS__)
+
 #define LASSERT_TYPE(func, args, index, expect)\
-    LASSERT(args, args->cell[index]->type==expect, "Function '%s' received incompatable types for argument %i.\nRecieved: %s\nExpected: %s", func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    LASSERT_CODE(args, args->cell[index]->type==expect, LERR_TYPE, "Function '%s' received incompatable types for argument %i.\nRecieved: %s\nExpected: %s", func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num)\
-    LASSERT(args, args->count==num, "Function '%s' received bad number of args for argument %i.\nRecieved: %i\nExpected: %i", func, args->count, num)
+    LASSERT_CODE(args, args->count==num, LERR_ARGS, "Function '%s' received bad number of args for argument %i.\nRecieved: %i\nExpected: %i", func, args->count, num)
 
 #define LASSERT_NOT_EMPTY(func, args, index)\
-    LASSERT(args, args->cell[index]->count!=0, "Function '%s' passed empty list for argument %i.", func, index);
+    LASSERT_CODE(args, args->cell[index]->count!=0, LERR_ARGS, "Function '%s' passed empty list for argument %i.", func, index);
 
 #ifdef _WIN32
 
@@ -41,10 +51,26 @@ char * readline(char * prompt)
 void add_history(char * unused){} //Empty add_history function since windows
                                   //supports history natively
 
+#include <malloc.h>
+#define malloc_usable_size _msize
+
 #elif __linux__
 
 #include <editline/readline.h>
 #include <editline/readline.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <ucontext.h>
+#include <malloc.h>
 
 #else
 
@@ -52,8 +78,215 @@ void add_history(char * unused){} //Empty add_history function since windows
 
 #endif
 
-//Parser Declarations
+struct lenv
+{
+    lenv* par;
+    int root; //def stops here instead of walking to the global env
+    int loop; //holds only loop variables, = on anything else goes to par
+    int count;
+    char** syms;
+    lval** vals;
+};
+
+//Allocation and symbol cache counters, reported with --stats
+typedef struct
+{
+    long allocs;
+    long frees;
+    long bytes; //held by values, see lheap_alloc
+    long hits;
+    long misses;
+    long jit_calls;
+    long jit_bails;
+} lstats;
+
+//Captured arguments of an error message
+#define LERR_MAX_ARGS 8
+#define LERR_FLAGS "-+ #0123456789."
+
+typedef struct lerrfmt lerrfmt;
+struct lerrfmt
+{
+    char* fmt;
+    int count;
+    char types[LERR_MAX_ARGS];
+    union
+    {
+        int i;
+        double d;
+        char* s;
+    } args[LERR_MAX_ARGS];
+};
+
+//Interned symbol. Every symbol lval with the same name points at the same
+//lsym, which caches the global binding the name last resolved to. The cache
+//is valid while version matches the context's, and is never used once the
+//name has been bound in a local env, since that binding could shadow it.
+typedef struct lsym lsym;
+struct lsym
+{
+    char* name;
+    int local;
+    long version;
+    lval* val;
+    long gen; //bumped when the global binding is replaced
+    lsym* next;
+};
+
+typedef struct ljit ljit;
+
+//Body of a lambda with its macros expanded and constants folded, shared
+//between copies of the lambda. It was made against the global bindings of
+//deps, and is only run while none of them were redefined or bound locally.
+typedef struct lfold lfold;
+struct lfold
+{
+    int refs;
+    lval* body;
+    int ndeps;
+    lsym** deps;
+    long* gens;
+};
+
+//Module loaded by require, see MODULES
+typedef struct lmod lmod;
+
+//Growable output buffer the printer serializes into
+typedef struct
+{
+    char* data;
+    size_t len;
+    size_t cap;
+} lbuf;
+
+//Walkers over nested values keep their own stack of these on the heap,
+//so nesting depth is bounded by memory rather than the C stack
+typedef struct
+{
+    lval* v;
+    lval* w; //the other value for lval_eq, the copy for lval_copy
+    int i; //next child, for printing
+} lwalk;
+
+typedef struct
+{
+    lwalk* items;
+    int count;
+    int cap;
+    lwalk local[32]; //small values never touch malloc
+} lwork;
+
+//Lazy sequence, see SEQUENCE_FUNCTIONS
+typedef struct lseq lseq;
+struct lseq
+{
+    int kind;
+    int refs;
+    double start;
+    double stop;
+    double step;
+    long n;
+    lval* f; //map, filter and iterate function
+    lval* x; //list, iterate seed and repeated value
+    char* path;
+    lseq* src;
+};
+
+//Coroutine, see COROUTINES
+typedef struct lchan lchan;
+typedef struct lco lco;
+struct lco
+{
+    ucontext_t uc;
+    char* stack;
+    lval* f; //function and arguments, until it starts
+    lval* a;
+    lchan* wait; //channel it is blocked on
+    lco* next; //in the ready queue or blocked list
+};
+
+//Eval server a context answers requests for, see EVAL_SERVER
+typedef struct lserver lserver;
+
+//Bounded channel, a ring buffer of values
+struct lchan
+{
+    int refs;
+    int cap;
+    int count;
+    int head;
+    int closed;
+    lval** items;
+};
+
+//Record type made by defrecord, see RECORDS
+typedef struct lrtype lrtype;
+struct lrtype
+{
+    int refs;
+    char* name;
+    int count;
+    char** fields;
+};
+
+//Record value, a fixed array of slots shared between copies
+typedef struct lrec lrec;
+struct lrec
+{
+    int refs;
+    lrtype* type;
+    lrec* next; //waiting to be freed, see lrec_del
+    int count;
+    lval* slots[];
+};
+
+//What a builtin accepts, so that a call whose arguments already fit can
+//skip the builtin's own checks, see BUILTIN_DESCRIPTORS
+#define LBD_VARIADIC -1 //one or more arguments, all of types[0]
+#define LBD_ANY -1
+typedef struct lbdesc lbdesc;
+struct lbdesc
+{
+    lbuiltin f;
+    int argc; //exact count, or LBD_VARIADIC
+    int types[3]; //of each argument, LBD_ANY for any type
+    lbuiltin fast; //f without the checks, or NULL if it has none
+    int pure; //same result for the same constant args, see lval_fold
+};
+
+#define LSYM_BUCKETS 1024
+
+//Limits on one evaluation, 0 is unlimited. See BUDGETS
+typedef struct
+{
+    long steps;
+    long bytes;
+    double seconds;
+} lbudget;
+
+//Which limit an evaluation went over
+enum { LOVER_NONE, LOVER_STEPS, LOVER_HEAP, LOVER_TIME };
+
+//Budget of a pmap caller its workers draw on together
+typedef struct
+{
+    long steps; //left to hand out
+    long bytes; //held by the caller and the workers
+    long max_bytes;
+} lshare;
+
+//Symbol table, shared with pmap workers so interning takes the lock
+typedef struct
+{
+    pthread_mutex_t lock;
+    lsym* buckets[LSYM_BUCKETS];
+} lsymtab;
 
+//Interpreter context. Everything one interpreter needs lives here, so
+//several contexts can run on separate threads in the same process.
+struct lctx
+{
+    //Parser Declarations
     mpc_parser_t* Number;
     mpc_parser_t* Symbol;
     mpc_parser_t* String;
@@ -63,40 +296,95 @@ void add_history(char * unused){} //Empty add_history function since windows
     mpc_parser_t* Expr;
     mpc_parser_t* Lispy;
 
-//Structs, typedefs, and enumerations
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
+    lenv* env;
+    lenv* snapshot;
+    FILE* out;
+    lstats stats;
+    lsymtab* syms;
+    long version; //bumped when a global binding is replaced
+    int caching; //off in pmap workers, which share syms with the caller
+    ljit* jits;
 
-//Possible Lisp types
-enum { LVAL_ERR, LVAL_FUN, LVAL_NUM, LVAL_QEXPR, LVAL_SEXPR, LVAL_STR, LVAL_SYM };
+    lbudget budget; //applied to each evaluation
+    lbudget limit; //in force for the current one
+    long steps; //counted a chunk at a time, fuel of them not used yet
+    long fuel;
+    long max_steps; //LONG_MAX when unlimited
+    long max_bytes; //held by values at once
+    double deadline; //0 when unlimited
+    int over; //which limit was hit, every eval fails until it is cleared
+    lshare* share; //of a pmap worker, NULL otherwise
+    long shared; //bytes already added to share
 
-typedef lval*(*lbuiltin)(lenv*, lval*);
+    lmod* mods; //required so far
+    lmod* snapshot_mods; //the ones required before the snapshot
+    lval* recur; //arguments of a recur on their way to its loop
 
-//Lisp value
-struct lval
-{
-    int type;
-    double num;
-    char* err;
-    char* sym;
-    char* str;
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
-    int count;
-    struct lval** cell;
+    lco* main; //NULL until the first spawn
+    lco* co; //running
+    lco* ready; //queue to run next
+    lco* ready_tail;
+    lco* blocked; //on a channel
+    lco* dead; //finished, freed once off its stack
+
+    lserver* server; //polled while a request evaluates, NULL otherwise
 };
 
-struct lenv
+//Context the current thread is evaluating in
+__thread lctx* nisp_ctx;
+
+//Compile global lambdas to native code, set by --jit
+int nisp_jit=FALSE;
+
+//Intern values def stores, set by --hash-cons. See Hash consing
+int nisp_hashcons=FALSE;
+
+//Budget new contexts start with, set by --max-steps, --max-heap and --max-time
+lbudget nisp_budget={0, 0, 0};
+
+//Values may also be built and printed by an embedding host outside of any
+//context, in which case they go uncounted and print to stdout
+FILE* lval_out(void)
 {
-    lenv* par;
-    int count;
-    char** syms;
-    lval** vals;
-};
+    return nisp_ctx ? nisp_ctx->out : stdout;
+}
+
+double lnow(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+lsym* lsym_intern(lsymtab* t, char* name)
+{
+    unsigned h=2166136261u;
+    for(char* p=name; *p; p++)
+    {
+        h=(h^(unsigned char) *p)*16777619u;
+    }
+    lsym** b=&t->buckets[h%LSYM_BUCKETS];
+    pthread_mutex_lock(&t->lock);
+    lsym* s=*b;
+    while(s && strcmp(s->name, name)!=0)
+    {
+        s=s->next;
+    }
+    if(!s)
+    {
+        s=malloc(sizeof(lsym));
+        s->name=malloc(strlen(name)+1);
+        strcpy(s->name, name);
+        s->local=FALSE;
+        s->version=-1;
+        s->val=NULL;
+        s->gen=0;
+        s->next=*b;
+        *b=s;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return s;
+}
 
 char* ltype_name(int t)
 {
@@ -109,6 +397,9 @@ char* ltype_name(int t)
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
         case LVAL_STR: return "String";
+        case LVAL_SEQ: return "Sequence";
+        case LVAL_CHAN: return "Channel";
+        case LVAL_REC: return "Record";
         default: return "Unknown";
     }
 }
@@ -122,25 +413,125 @@ int lval_eq(lval* x, lval* y);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_copy(lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_apply(lenv* e, lval* f, lval* a);
+lval* lval_eval_ref(lenv* e, lval* v);
+lval* lval_eval_code(lenv* e, lval* v);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 lval* lval_num(double x);
 lval* builtin_var(lenv* e, lval* a, char* func);
+lval* builtin_lambda(lenv* e, lval* a);
 lval* lval_err(char* fmt, ...);
 lval* lval_sexpr(void);
 lval* lval_join(lval* x, lval* y);
 lval* lval_str(char* s);
 lval* lval_read(mpc_ast_t* t);
+ljit* ljit_compile(lval* k, lval* f);
+void lerrfmt_del(lerrfmt* f);
+void lseq_del(lseq* s);
+void lchan_del(lchan* ch);
+void lrec_del(lrec* r);
+void lrtype_del(lrtype* t);
+void lfold_del(lfold* d);
+lval* lrec_apply(lval* f, lval* a);
+lval* lmacro_expand(lval* m, lval* v);
+lval* lbudget_err(lctx* c);
+int lbudget_spend(lctx* c);
+void lctx_settle(lctx* c);
+void lserver_yield(lserver* s);
+void lco_run(lctx* c);
+void lco_del_all(lctx* c);
+void lbuf_putc(lbuf* b, char c);
+void lbuf_lval(lbuf* b, lval* v);
+void lbuf_flush(lbuf* b);
+lval* lmod_read(char* path, int cached);
+lval* lval_copy_node(lval* v);
+lval* lval_own(lval* v);
+int lhc_release(lval* v);
+lval* lhc_intern(lval* v);
+int lval_nkids(lval* v);
+const lbdesc* lbdesc_find(lbuiltin f);
+int lbdesc_fits(const lbdesc* d, lval* a);
+
+//Memory values and envs own is allocated through these, so the context
+//can count the bytes held against its heap budget. Limits count from where
+//the count stands when they start, so malloc is only asked for sizes while
+//one is in force, and memory freed that was never counted only makes the
+//count low.
+int lheap_counting(void)
+{
+    return nisp_ctx && nisp_ctx->max_bytes!=LONG_MAX;
+}
+
+void* lheap_alloc(size_t n)
+{
+    void* p=malloc(n);
+    if(lheap_counting())
+    {
+        nisp_ctx->stats.bytes+=malloc_usable_size(p);
+        //Over the heap budget, have the next step check it
+        if(nisp_ctx->stats.bytes > nisp_ctx->max_bytes)
+        {
+            nisp_ctx->fuel=0;
+        }
+    }
+    return p;
+}
+
+void* lheap_realloc(void* p, size_t n)
+{
+    if(!lheap_counting())
+    {
+        return realloc(p, n);
+    }
+    nisp_ctx->stats.bytes-=malloc_usable_size(p);
+    p=realloc(p, n);
+    nisp_ctx->stats.bytes+=malloc_usable_size(p);
+    if(nisp_ctx->stats.bytes > nisp_ctx->max_bytes)
+    {
+        nisp_ctx->fuel=0;
+    }
+    return p;
+}
+
+void lheap_free(void* p)
+{
+    if(lheap_counting())
+    {
+        nisp_ctx->stats.bytes-=malloc_usable_size(p);
+    }
+    free(p);
+}
+
+//Constructors
+//Allocate an lval, counted against the current context. Values are the
+//most common allocation, so are counted at their size without asking malloc.
+lval* lval_new(int type)
+{
+    lval* v=malloc(sizeof(lval));
+    v->type=type;
+    v->refs=0;
+    v->pins=0;
+    v->retired=FALSE;
+    if(nisp_ctx)
+    {
+        nisp_ctx->stats.allocs++;
+        nisp_ctx->stats.bytes+=sizeof(lval);
+    }
+    return v;
+}
 
 //Constructors
 //Lisp Environment constructor
 lenv* lenv_new(void)
 {
-    lenv* e=malloc(sizeof(lenv));
+    lenv* e=lheap_alloc(sizeof(lenv));
     e->count=0;
     e->syms=NULL;
     e->vals=NULL;
     e->par=NULL;
+    e->root=FALSE;
+    e->loop=FALSE;
     return e;
 }
 
@@ -148,76 +539,143 @@ void lenv_del(lenv* e)
 {
     for(int i=0;i<e->count;i++)
     {
-        free(e->syms[i]);
+        lheap_free(e->syms[i]);
         lval_del(e->vals[i]);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    lheap_free(e->syms);
+    lheap_free(e->vals);
+    lheap_free(e);
 }
 
 //Destructors
 
 lenv* lenv_copy(lenv* e)
 {
-    lenv* n=malloc(sizeof(lenv));
+    lenv* n=lheap_alloc(sizeof(lenv));
     n->par=e->par;
+    n->root=e->root;
+    n->loop=e->loop;
     n->count=e->count;
-    n->syms=malloc(sizeof(char*)*n->count);
-    n->vals=malloc(sizeof(lval*)*n->count);
+    n->syms=lheap_alloc(sizeof(char*)*n->count);
+    n->vals=lheap_alloc(sizeof(lval*)*n->count);
     for(int i=0; i<e->count; i++)
     {
-        n->syms[i]=malloc(strlen(e->syms[i])+1);
+        n->syms[i]=lheap_alloc(strlen(e->syms[i])+1);
         strcpy(n->syms[i], e->syms[i]);
         n->vals[i]=lval_copy(e->vals[i]);
     }
     return n;
 }
 
+//Free a value replaced in an env, unless a call is still running it, see
+//lval_eval_code. Then the last call to finish frees it.
+void lenv_retire(lval* v)
+{
+    if(__atomic_load_n(&v->pins, __ATOMIC_ACQUIRE))
+    {
+        v->retired=TRUE;
+        return;
+    }
+    lval_del(v);
+}
+
+void lval_unpin(lval* v)
+{
+    if(__atomic_sub_fetch(&v->pins, 1, __ATOMIC_ACQ_REL)==0 && v->retired)
+    {
+        lval_del(v);
+    }
+}
+
 //Modifiers
 void lenv_put(lenv* e, lval* k, lval* v)
 {
-    for(int i=0; i<e->count; i++)
+    int i=0;
+    while(i<e->count && strcmp(e->syms[i], k->sym)!=0)
+    {
+        i++;
+    }
+    if(e->loop && i==e->count)
+    {
+        lenv_put(e->par, k, v);
+        return;
+    }
+    int global=(nisp_ctx && e==nisp_ctx->env);
+    if(!global && nisp_ctx && nisp_ctx->caching)
+    {
+        lsym* c=k->cache ? k->cache : lsym_intern(nisp_ctx->syms, k->sym);
+        c->local=TRUE;
+    }
+    if(i<e->count)
     {
-        if(strcmp(e->syms[i], k->sym)==0)
+        lenv_retire(e->vals[i]);
+        if(global)
         {
-            lval_del(e->vals[i]);
-            e->vals[i]=lval_copy(v);
-            return;
+            nisp_ctx->version++;
+            (k->cache ? k->cache : lsym_intern(nisp_ctx->syms, k->sym))->gen++;
         }
     }
-    //Increase size and reallocate
-    e->count++;
-    e->vals=realloc(e->vals, sizeof(lval*)*e->count);
-    e->syms=realloc(e->syms, sizeof(char*)*e->count);
+    else
+    {
+        //Increase size and reallocate
+        e->count++;
+        e->vals=lheap_realloc(e->vals, sizeof(lval*)*e->count);
+        e->syms=lheap_realloc(e->syms, sizeof(char*)*e->count);
+        e->syms[i]=lheap_alloc(strlen(k->sym)+1);
+        strcpy(e->syms[i], k->sym);
+    }
     //Move data
-    e->vals[e->count-1]=lval_copy(v);
-    e->syms[e->count-1]=malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+    e->vals[i]=lval_copy(v);
+    if(nisp_hashcons && (global || e->root))
+    {
+        e->vals[i]=lhc_intern(e->vals[i]);
+    }
+    if(global && nisp_jit && k->cache && v->type==LVAL_FUN && !v->builtin)
+    {
+        e->vals[i]->jit=ljit_compile(k, e->vals[i]);
+    }
 }
 
-lval* lenv_get(lenv* e, lval* k)
+//The value bound to k, not copied, or NULL if it is unbound
+lval* lenv_find(lenv* e, lval* k)
 {
-    for(int i=0;i<e->count;i++)
+    lsym* c=(nisp_ctx && nisp_ctx->caching) ? k->cache : NULL;
+    if(c)
     {
-        if(strcmp(e->syms[i], k->sym)==0)
+        if(!c->local && c->version==nisp_ctx->version)
         {
-            return lval_copy(e->vals[i]);
+            nisp_ctx->stats.hits++;
+            return c->val;
         }
+        nisp_ctx->stats.misses++;
     }
-    if(e->par)
-    {
-        return lenv_get(e->par, k);
-    }
-    else
+    for(; e; e=e->par)
     {
-        return lval_err("Unbound Symbol '%s'", k->sym);
+        for(int i=0;i<e->count;i++)
+        {
+            if(strcmp(e->syms[i], k->sym)==0)
+            {
+                if(c && !c->local && e==nisp_ctx->env)
+                {
+                    c->val=e->vals[i];
+                    c->version=nisp_ctx->version;
+                }
+                return e->vals[i];
+            }
+        }
     }
+    return NULL;
+}
+
+lval* lenv_get(lenv* e, lval* k)
+{
+    lval* v=lenv_find(e, k);
+    return v ? lval_copy(v) : lval_errc(LERR_UNBOUND, "Unbound Symbol '%s'", k->sym);
 }
 
 void lenv_def(lenv* e, lval* k, lval* v)
 {
-    while(e->par)
+    while(e->par && !e->root)
     {
         e=e->par;
     }
@@ -229,176 +687,390 @@ void lenv_def(lenv* e, lval* k, lval* v)
 ************************************************************/
 
 //Mathematicals
-lval* builtin_op(lenv* e, lval* a, char* op)
+//The operations themselves, on arguments already known to be numbers. The
+//builtins check their arguments and call these, and a call whose arguments
+//fit skips straight to them, see lbdesc.
+lval* lnum_add(lenv* e, lval* a)
 {
-    for(int i=0; i<a->count; i++)
+    double x=a->cell[0]->num;
+    for(int i=1; i<a->count; i++)
     {
-        LASSERT_TYPE(op,a,i,LVAL_NUM);
+        x+=a->cell[i]->num;
+    }
+    lval_del(a);
+    return lval_num(x);
+}
+
+lval* lnum_sub(lenv* e, lval* a)
+{
+    double x=a->cell[0]->num;
+    for(int i=1; i<a->count; i++)
+    {
+        x-=a->cell[i]->num;
     }
-    lval* x =lval_pop(a,0);
-    if(strcmp(op, "=")==0 && a->count==0)
+    lval_del(a);
+    return lval_num(x);
+}
+
+lval* lnum_mul(lenv* e, lval* a)
+{
+    double x=a->cell[0]->num;
+    for(int i=1; i<a->count; i++)
     {
-        x->num=-x->num;
+        x*=a->cell[i]->num;
     }
-    while(a->count > 0)
+    lval_del(a);
+    return lval_num(x);
+}
+
+lval* lnum_pow(lenv* e, lval* a)
+{
+    double x=a->cell[0]->num;
+    for(int i=1; i<a->count; i++)
     {
-        //get second value
-        lval* y=lval_pop(a,0);
+        x=pow(x, a->cell[i]->num);
+    }
+    lval_del(a);
+    return lval_num(x);
+}
 
-        //Operation carryout
-        if(strcmp(op, "+")==0 || strcmp(op, "add")==0) {x->num += y->num;}
-        if(strcmp(op, "-")==0 || strcmp(op, "sub")==0) {x->num -= y->num;}
-        if(strcmp(op, "*")==0 || strcmp(op, "mul")==0) {x->num *= y->num;}
-        if(strcmp(op, "^")==0 || strcmp(op, "pow")==0) {x->num=pow(x->num,y->num);}
-        if(strcmp(op, "/")==0 || strcmp(op, "div")==0) 
+lval* lnum_div(lenv* e, lval* a)
+{
+    double x=a->cell[0]->num;
+    for(int i=1; i<a->count; i++)
+    {
+        if(a->cell[i]->num==0)
         {
-            if(y->num==0)
-            {
-                lval_del(x);
-                lval_del(y);
-                x=lval_err("Divide by zero error!");
-                break;
-            }
-            x->num/=y->num;
+            lval_del(a);
+            return lval_errc(LERR_DIV_ZERO, "Divide by zero error!");
         }
-        if(strcmp(op, "%")==0 || strcmp(op, "mod")==0) 
-        { 
-            if(y->num==0)
-            {
-                lval_del(x);
-                lval_del(y);
-                x=lval_err("Divide by zero error!");
-                break;
-            }
-            x->num=(double) ((int) x->num % (int) y->num);
+        x/=a->cell[i]->num;
+    }
+    lval_del(a);
+    return lval_num(x);
+}
+
+lval* lnum_mod(lenv* e, lval* a)
+{
+    double x=a->cell[0]->num;
+    for(int i=1; i<a->count; i++)
+    {
+        //Integer modulus, so a divisor that truncates to 0 divides by zero
+        //too. By -1 the result is 0, but INT_MIN % -1 traps.
+        int y=(int) a->cell[i]->num;
+        if(y==0)
+        {
+            lval_del(a);
+            return lval_errc(LERR_DIV_ZERO, "Divide by zero error!");
         }
-        lval_del(y);
+        x=y==-1 ? 0 : (double) ((int) x % y);
     }
     lval_del(a);
-    return x;
+    return lval_num(x);
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op, lbuiltin f)
+{
+    for(int i=0; i<a->count; i++)
+    {
+        LASSERT_TYPE(op,a,i,LVAL_NUM);
+    }
+    return f(e, a);
 }
 
 lval* builtin_add(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "+");
+    return builtin_op(e, a, "+", lnum_add);
 }
 
 lval* builtin_sub(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "-");
+    return builtin_op(e, a, "-", lnum_sub);
 }
 
 lval* builtin_mul(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "*");
+    return builtin_op(e, a, "*", lnum_mul);
 }
 
 lval* builtin_div(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "/");
+    return builtin_op(e, a, "/", lnum_div);
 }
 
 lval* builtin_pow(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "^");
+    return builtin_op(e, a, "^", lnum_pow);
 }
 
 lval* builtin_mod(lenv* e, lval* a)
 {
-    return builtin_op(e, a, "%");
+    return builtin_op(e, a, "%", lnum_mod);
 }
 
 //Conditionals
-lval* builtin_cmp(lenv* e, lval* a, char* op)
+lval* lcmp_eq(lenv* e, lval* a)
 {
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if(strcmp(op, "==")==0)
-    {
-        r=lval_eq(a->cell[0], a->cell[1]);
-    }
-    if(strcmp(op, "!=")==0)
-    {
-        r=!(lval_eq(a->cell[0], a->cell[1]));
-    }
+    int r=lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* lcmp_ne(lenv* e, lval* a)
+{
+    int r=!lval_eq(a->cell[0], a->cell[1]);
     lval_del(a);
     return lval_num(r);
 }
 
+lval* builtin_cmp(lenv* e, lval* a, char* op, lbuiltin f)
+{
+    LASSERT_NUM(op, a, 2);
+    return f(e, a);
+}
+
 lval* builtin_if(lenv* e, lval* a)
 {
     LASSERT_NUM("if", a, 3);
     LASSERT_TYPE("if", a, 0, LVAL_NUM);
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
-    lval* x;
-    a->cell[1]->type=LVAL_SEXPR;
-    a->cell[2]->type=LVAL_SEXPR;
-    if(a->cell[0]->num)
-    {
-        x=lval_eval(e, lval_pop(a, 1));
-    }
-    else
-    {
-        x=lval_eval(e, lval_pop(a, 2));
-    }
+    lval* x=lval_eval_code(e, a->cell[a->cell[0]->num ? 1 : 2]);
     lval_del(a);
     return x;
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op)
+lval* lnum_gt(lenv* e, lval* a)
 {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
-    int r;
-    if(strcmp(op, ">") == 0)
-    {
-        r=(a->cell[0]->num > a->cell[1]->num);
-    }
-    if(strcmp(op, "<") == 0)
-    {
-        r=(a->cell[0]->num < a->cell[1]->num);
-    }
-    if(strcmp(op, ">=") == 0)
-    {
-        r=(a->cell[0]->num >= a->cell[1]->num);
-    }
-    if(strcmp(op, "<=") == 0)
-    {
-        r=(a->cell[0]->num <= a->cell[1]->num);
-    }
+    int r=(a->cell[0]->num > a->cell[1]->num);
     lval_del(a);
     return lval_num(r);
 }
 
-lval* builtin_eq(lenv* e, lval* a)
+lval* lnum_lt(lenv* e, lval* a)
 {
-    return builtin_cmp(e, a, "==");
+    int r=(a->cell[0]->num < a->cell[1]->num);
+    lval_del(a);
+    return lval_num(r);
 }
-lval* builtin_ne(lenv* e, lval* a)
+
+lval* lnum_ge(lenv* e, lval* a)
 {
-    return builtin_cmp(e, a, "!=");
-}
+    int r=(a->cell[0]->num >= a->cell[1]->num);
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* lnum_le(lenv* e, lval* a)
+{
+    int r=(a->cell[0]->num <= a->cell[1]->num);
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op, lbuiltin f)
+{
+    LASSERT_NUM(op, a, 2);
+    LASSERT_TYPE(op, a, 0, LVAL_NUM);
+    LASSERT_TYPE(op, a, 1, LVAL_NUM);
+    return f(e, a);
+}
+
+lval* builtin_eq(lenv* e, lval* a)
+{
+    return builtin_cmp(e, a, "==", lcmp_eq);
+}
+lval* builtin_ne(lenv* e, lval* a)
+{
+    return builtin_cmp(e, a, "!=", lcmp_ne);
+}
 lval* builtin_gt(lenv* e, lval* a)
 {
-    return builtin_ord(e, a, ">");
+    return builtin_ord(e, a, ">", lnum_gt);
 }
 
 lval* builtin_lt(lenv* e, lval* a)
 {
-    return builtin_ord(e, a, "<");
+    return builtin_ord(e, a, "<", lnum_lt);
 }
 
 lval* builtin_ge(lenv* e, lval* a)
 {
-    return builtin_ord(e, a, ">=");
+    return builtin_ord(e, a, ">=", lnum_ge);
 }
 
 lval* builtin_le(lenv* e, lval* a)
 {
-    return builtin_ord(e, a, "<=");
+    return builtin_ord(e, a, "<=", lnum_le);
+}
+
+//Iteration
+//The loops evaluate their body again in the caller's frame rather than
+//calling a function, so they run in constant stack and memory however
+//many times they go round
+
+//(while {cond} {body}) evaluates body for as long as cond is true
+lval* builtin_while(lenv* e, lval* a)
+{
+    LASSERT_NUM("while", a, 2);
+    LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+    for(;;)
+    {
+        //A step per iteration, so that even an empty loop runs out
+        if(lbudget_spend(nisp_ctx))
+        {
+            lval_del(a);
+            return lbudget_err(nisp_ctx);
+        }
+        lval* c=lval_eval_code(e, a->cell[0]);
+        if(c->type!=LVAL_NUM)
+        {
+            lval* err=c->type==LVAL_ERR ? c : lval_errc(LERR_TYPE, "Function 'while' condition evaluated to %s.\nExpected: %s", ltype_name(c->type), ltype_name(LVAL_NUM));
+            if(err!=c)
+            {
+                lval_del(c);
+            }
+            lval_del(a);
+            return err;
+        }
+        int go=(c->num!=0);
+        lval_del(c);
+        if(!go)
+        {
+            break;
+        }
+        lval* x=lval_eval_code(e, a->cell[1]);
+        if(x->type==LVAL_ERR)
+        {
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//(dotimes {i n} {body}) evaluates body with i bound to 0 up to n-1, in a
+//frame of its own so i is gone once the loop is. = on anything else still
+//updates the caller's locals.
+lval* builtin_dotimes(lenv* e, lval* a)
+{
+    LASSERT_NUM("dotimes", a, 2);
+    LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("dotimes", a, 1, LVAL_QEXPR);
+    lval* spec=a->cell[0];
+    LASSERT_CODE(a, spec->count==2 && spec->cell[0]->type==LVAL_SYM, LERR_ARGS, "Function 'dotimes' expected {symbol count} for argument 0");
+    lval* n=lval_eval_ref(e, spec->cell[1]);
+    if(n->type!=LVAL_NUM)
+    {
+        lval* err=n->type==LVAL_ERR ? n : lval_errc(LERR_TYPE, "Function 'dotimes' count evaluated to %s.\nExpected: %s", ltype_name(n->type), ltype_name(LVAL_NUM));
+        if(err!=n)
+        {
+            lval_del(n);
+        }
+        lval_del(a);
+        return err;
+    }
+    double count=n->num;
+    lval_del(n);
+    lenv* l=lenv_new();
+    l->par=e;
+    lval* x=NULL;
+    for(double i=0; i<count; i++)
+    {
+        if(lbudget_spend(nisp_ctx))
+        {
+            x=lbudget_err(nisp_ctx);
+            break;
+        }
+        lval* k=lval_num(i);
+        lenv_put(l, spec->cell[0], k);
+        lval_del(k);
+        l->loop=TRUE;
+        x=lval_eval_code(l, a->cell[1]);
+        if(x->type==LVAL_ERR)
+        {
+            break;
+        }
+        lval_del(x);
+        x=NULL;
+    }
+    lenv_del(l);
+    lval_del(a);
+    return x ? x : lval_sexpr();
+}
+
+//(recur values...) hands the values to the enclosing loop, as an error so
+//they unwind to it whatever evaluated the recur. It stops at the body of a
+//function, see lval_unrecur, so only a loop in the same body gets them.
+lval* builtin_recur(lenv* e, lval* a)
+{
+    if(nisp_ctx->recur)
+    {
+        lval_del(nisp_ctx->recur);
+    }
+    nisp_ctx->recur=a;
+    return lval_errc(LERR_RECUR, "Function 'recur' called outside of loop");
+}
+
+//(loop {sym init ...} {body}) binds each sym to its init in a new frame and
+//evaluates body, again with the new values each time it ends in recur
+lval* builtin_loop(lenv* e, lval* a)
+{
+    LASSERT_NUM("loop", a, 2);
+    LASSERT_TYPE("loop", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("loop", a, 1, LVAL_QEXPR);
+    lval* binds=a->cell[0];
+    LASSERT_CODE(a, binds->count%2==0, LERR_ARGS, "Function 'loop' expected symbol and value pairs for argument 0");
+    for(int i=0; i<binds->count; i+=2)
+    {
+        LASSERT(a, binds->cell[i]->type==LVAL_SYM, "Function 'loop' cannot define non-symbolic value.\nReceived: %s\nExpected: %s", ltype_name(binds->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+    lenv* l=lenv_new();
+    l->par=e;
+    lval* x=NULL;
+    for(int i=0; i<binds->count; i+=2)
+    {
+        lval* v=lval_eval_ref(l, binds->cell[i+1]);
+        if(v->type==LVAL_ERR)
+        {
+            x=v;
+            break;
+        }
+        lenv_put(l, binds->cell[i], v);
+        lval_del(v);
+    }
+    while(!x)
+    {
+        if(lbudget_spend(nisp_ctx))
+        {
+            x=lbudget_err(nisp_ctx);
+            break;
+        }
+        x=lval_eval_code(l, a->cell[1]);
+        if(x->type!=LVAL_ERR || x->code!=LERR_RECUR || !nisp_ctx->recur)
+        {
+            break;
+        }
+        lval* r=nisp_ctx->recur;
+        nisp_ctx->recur=NULL;
+        lval_del(x);
+        x=NULL;
+        if(r->count!=binds->count/2)
+        {
+            x=lval_errc(LERR_ARGS, "Function 'recur' received bad number of args.\nRecieved: %i\nExpected: %i", r->count, binds->count/2);
+        }
+        for(int i=0; !x && i<r->count; i++)
+        {
+            lenv_put(l, binds->cell[2*i], r->cell[i]);
+        }
+        lval_del(r);
+    }
+    lenv_del(l);
+    lval_del(a);
+    return x;
 }
 
 lval* builtin_def(lenv* e, lval*a)
@@ -439,56 +1111,93 @@ lval* builtin_load(lenv* e, lval* a)
 {
     LASSERT_NUM("load", a, 1);
     LASSERT_TYPE("load", a, 0, LVAL_STR);
-    mpc_result_t r;
-    if(mpc_parse_contents(a->cell[0]->str, Lispy, &r))
+    lval* expr=lmod_read(a->cell[0]->str, FALSE);
+    lval_del(a);
+    if(expr->type==LVAL_ERR)
     {
-        lval* expr=lval_read(r.output);
-        mpc_ast_delete(r.output);
-        while(expr->count)
-        {
-            lval* x=lval_eval(e,lval_pop(expr, 0));
-            if(x->type==LVAL_ERR)
-            {
-                lval_println(x);
-            }
-            lval_del(x);
-        }
-        lval_del(expr);
-        lval_del(a);
-        return lval_sexpr();
+        return expr;
     }
-    else
+    while(expr->count)
     {
-        char* err_msg=mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-        lval* err=lval_err("Could not load library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
-        return err;
+        lval* x=lval_eval(e,lval_pop(expr, 0));
+        if(x->type==LVAL_ERR)
+        {
+            lval_println(x);
+        }
+        lval_del(x);
     }
+    lval_del(expr);
+    return lval_sexpr();
 }
 
 lval* builtin_print(lenv* e, lval* a)
 {
+    lbuf b={NULL, 0, 0};
     for(int i=0; i<a->count; i++)
     {
-        lval_print(a->cell[i]);
-        putchar(' ');
+        lbuf_lval(&b, a->cell[i]);
+        lbuf_putc(&b, ' ');
     }
-    putchar('\n');
+    lbuf_putc(&b, '\n');
+    lbuf_flush(&b);
     lval_del(a);
     return lval_sexpr();
 }
 
+//The printed form of a value as a string. Strings are returned as they are.
+lval* builtin_to_string(lenv* e, lval* a)
+{
+    LASSERT_NUM("to-string", a, 1);
+    if(a->cell[0]->type==LVAL_STR)
+    {
+        return lval_take(a, 0);
+    }
+    lbuf b={NULL, 0, 0};
+    lbuf_lval(&b, a->cell[0]);
+    lbuf_putc(&b, '\0');
+    lval* x=lval_str(b.data);
+    free(b.data);
+    lval_del(a);
+    return x;
+}
+
 lval* builtin_error(lenv* e, lval* a)
 {
     LASSERT_NUM("error", a, 1);
     LASSERT_TYPE("error", a, 0, LVAL_STR);
-    lval* err=lval_err(a->cell[0]->str);
+    lval* err=lval_errc(LERR_USER, "%s", a->cell[0]->str);
     lval_del(a);
     return err;
 }
 
+//Evaluate body, handing any error to the handler. A Q-Expression handler
+//is evaluated in place of the body, a function is called with the message.
+lval* builtin_try(lenv* e, lval* a)
+{
+    LASSERT_NUM("try", a, 2);
+    LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+    LASSERT_CODE(a, a->cell[1]->type==LVAL_QEXPR || a->cell[1]->type==LVAL_FUN, LERR_TYPE, "Function '%s' received incompatable types for argument %i.\nRecieved: %s\nExpected: %s or %s", "try", 1, ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_FUN));
+    lval* x=lval_eval_code(e, a->cell[0]);
+    if(x->type!=LVAL_ERR || x->code==LERR_RECUR)
+    {
+        lval_del(a);
+        return x;
+    }
+    lval* h=lval_take(a, 1);
+    if(h->type==LVAL_QEXPR)
+    {
+        lval_del(x);
+        x=lval_eval_code(e, h);
+        lval_del(h);
+        return x;
+    }
+    lval* msg=lval_str(lval_err_msg(x));
+    lval_del(x);
+    x=lval_call(e, h, lval_add(lval_sexpr(), msg));
+    lval_del(h);
+    return x;
+}
+
 //Get head of list
 lval* builtin_head(lenv* e, lval* a)
 {
@@ -528,9 +1237,9 @@ lval* builtin_eval(lenv* e, lval* a)
 {
     LASSERT_NUM("eval", a, 1);
     LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-    lval* x=lval_take(a,0);
-    x->type=LVAL_SEXPR;
-    return lval_eval(e, x);
+    lval* x=lval_eval_code(e, a->cell[0]);
+    lval_del(a);
+    return x;
 }
 
 lval* builtin_join(lenv* e, lval* a)  //nioj eht yvan
@@ -560,7 +1269,7 @@ lval* builtin_join(lenv* e, lval* a)  //nioj eht yvan
 lval* lval_add(lval* v, lval* x)
 {
     v->count++;
-    v->cell=realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell=lheap_realloc(v->cell, sizeof(lval*) * v->count);
     v->cell[v->count-1]=x;
     return v;
 }
@@ -574,8 +1283,8 @@ lval* lval_pop(lval* v, int i)
     //Move list head, change item count, & reallocate
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
     v->count--;
-    v->cell=realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+    v->cell=lheap_realloc(v->cell, sizeof(lval*) * v->count);
+    return lval_own(x);
 }
 
 lval* lval_take(lval* v, int i)
@@ -585,580 +1294,6473 @@ lval* lval_take(lval* v, int i)
     return x;
 }
 
-//Print functions
-//Print expression
-void lval_print_expr(lval* v, char open, char close)
+//Worklists
+void lwork_init(lwork* w)
 {
-    putchar(open);
-    for(int i=0; i<v->count; i++)
+    w->items=w->local;
+    w->count=0;
+    w->cap=sizeof(w->local)/sizeof(w->local[0]);
+}
+
+void lwork_push(lwork* w, lval* v, lval* other)
+{
+    if(w->count==w->cap)
     {
-        lval_print(v->cell[i]);
-        if(i!=(v->count-1))
+        w->cap*=2;
+        if(w->items==w->local)
+        {
+            w->items=malloc(sizeof(lwalk) * w->cap);
+            memcpy(w->items, w->local, sizeof(w->local));
+        }
+        else
         {
-            putchar(' ');
+            w->items=realloc(w->items, sizeof(lwalk) * w->cap);
         }
     }
-    putchar(close);
+    lwalk* x=&w->items[w->count++];
+    x->v=v;
+    x->w=other;
+    x->i=0;
 }
 
-//Lisp value print
-void lval_print(lval* v)
+void lwork_free(lwork* w)
 {
-    switch(v->type)
+    if(w->items!=w->local)
     {
-        case LVAL_NUM:
-            (v->num-round(v->num)!=0)
-                ? printf("%.3f",v->num)
-                : printf("%d", (int) v->num);
-            break;
-        case LVAL_ERR:
-            printf("Error: %s",v->err);
-            break;
-        case LVAL_SYM:
-            printf("%s",v->sym);
-            break;
-        case LVAL_SEXPR:
-            lval_print_expr(v, '(', ')');
-            break;
-        case LVAL_QEXPR:
-            lval_print_expr(v, '{', '}');
-            break;
-        case LVAL_FUN:
-            if(v->builtin)
-            {
-                printf("<builtin>");
-            }
-            else
-            {
-                printf("(\\ ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
-            }
-            break;
-        case LVAL_STR:
-            lval_print_str(v);
-            break;
+        free(w->items);
     }
 }
 
-lval* lval_read_str(mpc_ast_t* t)
+//Hash consing. With --hash-cons, values stored by def are interned in one
+//table shared by every context, so structurally equal numbers, strings,
+//symbols and lists of interned values are a single node counting its
+//owners in refs. Interned nodes are never changed: copying one takes a
+//reference, two of them are equal only if they are the same node, and
+//lval_own gives back a private node before anything is changed. The table
+//holds no references itself, a node leaves it with its last owner.
+
+typedef struct
 {
-    t->contents[strlen(t->contents)-1]='\0';
-    char* unescaped=malloc(strlen(t->contents+1)+1);
-    strcpy(unescaped, t->contents+1);
-    unescaped=mpcf_unescape(unescaped);
-    lval* str=lval_str(unescaped);
-    free(unescaped);
-    return str;
-}
+    lval* v;
+    uint64_t h;
+} lhcslot;
 
-void lval_print_str(lval* v)
+typedef struct
 {
-    char* escaped=malloc(strlen(v->str)+1);
-    strcpy(escaped, v->str);
-    escaped=mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
-}
+    pthread_mutex_t lock;
+    lhcslot* slots; //open addressing, cap is a power of two
+    size_t cap;
+    size_t count;
+} lhctab;
 
-void lval_println(lval* v)
+lhctab lhc_table={PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+uint64_t lhc_mix(uint64_t h, uint64_t x)
 {
-    lval_print(v);
-    putchar('\n');
+    h=(h^x)*1099511628211u;
+    return h^(h>>29);
 }
 
-//Equal to
-int lval_eq(lval* x, lval* y)
+uint64_t lhc_hash(lval* v)
 {
-    if(x->type != y->type)
-    {
-        return 0;
-    }
-    switch (x->type)
+    uint64_t h=lhc_mix(14695981039346656037u, v->type);
+    uint64_t bits;
+    switch(v->type)
     {
         case LVAL_NUM:
-            return (x->num==y->num);
-        case LVAL_ERR:
-            return (strcmp(x->err, y->err)==0);
+            memcpy(&bits, &v->num, sizeof(bits));
+            return lhc_mix(h, bits);
         case LVAL_SYM:
-            return (strcmp(x->sym, y->sym)==0);
-        case LVAL_FUN:
-            if( x->builtin || y->builtin )
-            {
-                return x->builtin==y->builtin;
-            }
-            else
-            {
-                return (lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body));
-            }
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if(x->count!=y->count)
-            {
-                return 0;
-            }
-            for(int i=0; i<x->count; i++)
+        case LVAL_STR:
+            //Symbols carry their context's interned lsym, so are kept apart
+            h=lhc_mix(h, v->type==LVAL_SYM ? (uintptr_t) v->cache : 0);
+            for(char* p=v->type==LVAL_SYM ? v->sym : v->str; *p; p++)
             {
-                if(!lval_eq(x->cell[i], y->cell[i]))
-                {
-                    return 0;
-                }
+                h=(h^(unsigned char) *p)*1099511628211u;
             }
-            return 1;
-            break;
-        case LVAL_STR:
-            return (strcmp(x->str, y->str)==0);
+            return lhc_mix(h, 0);
     }
-    return 0;
+    //Children are interned, so their addresses stand for their contents
+    for(int i=0; i<v->count; i++)
+    {
+        h=lhc_mix(h, (uintptr_t) v->cell[i]);
+    }
+    return lhc_mix(h, v->count);
 }
 
-lval* lval_copy(lval* v)
+//NaN and -0 aren't interned, since pointer equality would disagree with ==
+int lhc_internable(lval* v)
 {
-    lval* x=malloc(sizeof(lval));
-    x->type = v->type;
     switch(v->type)
     {
-        case LVAL_FUN: 
-            if(v->builtin)
-            {
-                x->builtin=v->builtin;
-            }
-            else
-            {
-                x->builtin=NULL;
-                x->env=lenv_copy(v->env);
-                x->formals=lval_copy(v->formals);
-                x->body=lval_copy(v->body);
-            }
-            break;
-        case LVAL_NUM: 
-            x->num = v->num; 
-            break;
-        case LVAL_ERR:
-            x->err=malloc(strlen(v->err)+1);
-            strcpy(x->err, v->err);
-            break;
+        case LVAL_NUM:
+            return !isnan(v->num) && !(v->num==0 && signbit(v->num));
         case LVAL_SYM:
-            x->sym=malloc(strlen(v->sym)+1);
-            strcpy(x->sym, v->sym);
-            break;
+        case LVAL_STR:
+            return TRUE;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
-            x->count=v->count;
-            x->cell=malloc(sizeof(lval*) * x->count);
-            for(int i=0; i< x->count; i++)
+            for(int i=0; i<v->count; i++)
             {
-                x->cell[i]=lval_copy(v->cell[i]);
+                if(!v->cell[i]->refs)
+                {
+                    return FALSE;
+                }
             }
-            break;
-        case LVAL_STR:
-            x->str=malloc(strlen(v->str)+1);
-            strcpy(x->str, v->str);
-            break;
+            return TRUE;
     }
-    return x;
+    return FALSE;
 }
 
-//delete lval
-void lval_del(lval* v)
+int lhc_same(lval* x, lval* y)
 {
-    switch(v->type)
+    if(x->type!=y->type)
+    {
+        return FALSE;
+    }
+    switch(x->type)
     {
         case LVAL_NUM:
-            break;
-        case LVAL_ERR:
-            free(v->err); //free allocated string
-            break;
+            return x->num==y->num;
         case LVAL_SYM:
-            free(v->sym); //free allocated string
-            break;
-        //recurse over expression to free allocated memory
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            for(int i=0; i<v->count; i++)
+            return x->cache==y->cache && strcmp(x->sym, y->sym)==0;
+        case LVAL_STR:
+            return strcmp(x->str, y->str)==0;
+    }
+    if(x->count!=y->count)
+    {
+        return FALSE;
+    }
+    for(int i=0; i<x->count; i++)
+    {
+        if(x->cell[i]!=y->cell[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+//Take a reference to an interned node, unless its last owner is already
+//on the way to removing it
+int lhc_ref(lval* v)
+{
+    int r=__atomic_load_n(&v->refs, __ATOMIC_ACQUIRE);
+    while(r>0)
+    {
+        if(__atomic_compare_exchange_n(&v->refs, &r, r+1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void lhc_grow(lhctab* t)
+{
+    size_t cap=t->cap ? t->cap*2 : 1024;
+    lhcslot* slots=calloc(cap, sizeof(lhcslot));
+    for(size_t i=0; i<t->cap; i++)
+    {
+        if(t->slots[i].v)
+        {
+            size_t k=t->slots[i].h & (cap-1);
+            while(slots[k].v)
+            {
+                k=(k+1) & (cap-1);
+            }
+            slots[k]=t->slots[i];
+        }
+    }
+    free(t->slots);
+    t->slots=slots;
+    t->cap=cap;
+}
+
+//The interned node equal to v, which v becomes if there is none
+lval* lhc_node(lval* v)
+{
+    if(!lhc_internable(v))
+    {
+        return v;
+    }
+    uint64_t h=lhc_hash(v);
+    lhctab* t=&lhc_table;
+    pthread_mutex_lock(&t->lock);
+    if((t->count+1)*2>t->cap)
+    {
+        lhc_grow(t);
+    }
+    size_t i=h & (t->cap-1);
+    for(; t->slots[i].v; i=(i+1) & (t->cap-1))
+    {
+        lval* x=t->slots[i].v;
+        if(t->slots[i].h==h && lhc_same(x, v) && lhc_ref(x))
+        {
+            pthread_mutex_unlock(&t->lock);
+            lval_del(v);
+            return x;
+        }
+    }
+    v->refs=1;
+    t->slots[i].v=v;
+    t->slots[i].h=h;
+    t->count++;
+    pthread_mutex_unlock(&t->lock);
+    return v;
+}
+
+//Drop a reference. TRUE if it was the last, and the node is now the
+//caller's to free like any other.
+int lhc_release(lval* v)
+{
+    if(__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL)>0)
+    {
+        return FALSE;
+    }
+    lhctab* t=&lhc_table;
+    size_t mask;
+    pthread_mutex_lock(&t->lock);
+    mask=t->cap-1;
+    size_t i=lhc_hash(v) & mask;
+    while(t->slots[i].v!=v)
+    {
+        i=(i+1) & mask;
+    }
+    //Shift later entries of the run back, so lookups never hit a gap
+    for(size_t j=(i+1) & mask; t->slots[j].v; j=(j+1) & mask)
+    {
+        size_t k=t->slots[j].h & mask;
+        if((j>i && (k<=i || k>j)) || (j<i && k<=i && k>j))
+        {
+            t->slots[i]=t->slots[j];
+            i=j;
+        }
+    }
+    t->slots[i].v=NULL;
+    t->count--;
+    pthread_mutex_unlock(&t->lock);
+    return TRUE;
+}
+
+//Intern v and everything in it that can be, consuming v
+lval* lhc_intern(lval* v)
+{
+    if(v->refs || v->type==LVAL_FUN || !lval_nkids(v))
+    {
+        return v->refs ? v : lhc_node(v);
+    }
+    lwork w;
+    lwork_init(&w);
+    lwork_push(&w, v, NULL);
+    while(w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==p->v->count)
+        {
+            lval* x=lhc_node(p->v);
+            if(--w.count)
+            {
+                p=&w.items[w.count-1];
+                p->v->cell[p->i-1]=x;
+            }
+            else
+            {
+                v=x;
+            }
+            continue;
+        }
+        lval* x=p->v->cell[p->i++];
+        if(x->refs)
+        {
+            continue;
+        }
+        if((x->type==LVAL_SEXPR || x->type==LVAL_QEXPR) && x->count)
+        {
+            lwork_push(&w, x, NULL);
+        }
+        else
+        {
+            p->v->cell[p->i-1]=lhc_node(x);
+        }
+    }
+    lwork_free(&w);
+    return v;
+}
+
+//v, or a private copy of it to change if it is interned. The copy's
+//children stay interned.
+lval* lval_own(lval* v)
+{
+    if(!v->refs)
+    {
+        return v;
+    }
+    lval* x=lval_copy_node(v);
+    if(v->type==LVAL_SEXPR || v->type==LVAL_QEXPR)
+    {
+        for(int i=0; i<v->count; i++)
+        {
+            x->cell[i]=v->cell[i];
+            __atomic_add_fetch(&x->cell[i]->refs, 1, __ATOMIC_ACQ_REL);
+        }
+    }
+    lval_del(v);
+    return x;
+}
+
+//Print functions
+//Values are serialized into an lbuf and written out in one block, rather
+//than a stdio call per element
+void lbuf_reserve(lbuf* b, size_t n)
+{
+    if(b->len+n > b->cap)
+    {
+        b->cap=b->cap ? b->cap*2 : 256;
+        while(b->len+n > b->cap)
+        {
+            b->cap*=2;
+        }
+        b->data=realloc(b->data, b->cap);
+    }
+}
+
+void lbuf_putc(lbuf* b, char c)
+{
+    lbuf_reserve(b, 1);
+    b->data[b->len++]=c;
+}
+
+void lbuf_write(lbuf* b, const char* s, size_t n)
+{
+    lbuf_reserve(b, n);
+    memcpy(b->data+b->len, s, n);
+    b->len+=n;
+}
+
+void lbuf_puts(lbuf* b, const char* s)
+{
+    lbuf_write(b, s, strlen(s));
+}
+
+void lbuf_printf(lbuf* b, const char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    int n=vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+    lbuf_reserve(b, n+1);
+    va_start(va, fmt);
+    vsnprintf(b->data+b->len, n+1, fmt, va);
+    va_end(va);
+    b->len+=n;
+}
+
+//Decimal digits of n, zero padded to width
+void lbuf_digits(lbuf* b, unsigned long long n, int width)
+{
+    char tmp[24];
+    int i=sizeof(tmp);
+    do
+    {
+        tmp[--i]='0'+n%10;
+        n/=10;
+        width--;
+    } while(n || width>0);
+    lbuf_write(b, tmp+i, sizeof(tmp)-i);
+}
+
+//Same text as the "%d" of (int) x or "%.3f" of x the printer always used.
+//%.3f is done by hand when x*1000 is clearly not halfway between two
+//integers, otherwise printf's exact rounding decides.
+void lbuf_num(lbuf* b, double x)
+{
+    if(x-round(x)==0)
+    {
+        long long n=(int) x;
+        if(n<0)
+        {
+            lbuf_putc(b, '-');
+            n=-n;
+        }
+        lbuf_digits(b, n, 1);
+        return;
+    }
+    double m=fabs(x)*1000;
+    double f=floor(m);
+    if(m<1e15 && fabs(m-f-0.5)>1e-3)
+    {
+        unsigned long long n=(unsigned long long) f + (m-f>0.5);
+        if(signbit(x))
+        {
+            lbuf_putc(b, '-');
+        }
+        lbuf_digits(b, n/1000, 1);
+        lbuf_putc(b, '.');
+        lbuf_digits(b, n%1000, 3);
+        return;
+    }
+    char tmp[512];
+    lbuf_write(b, tmp, snprintf(tmp, sizeof(tmp), "%.3f", x));
+}
+
+//Quote and escape a string the way mpcf_escape does, without the copy
+void lbuf_str(lbuf* b, const char* s)
+{
+    lbuf_putc(b, '"');
+    for(const char* p=s; *p; p++)
+    {
+        switch(*p)
+        {
+            case '\a': lbuf_write(b, "\\a", 2); break;
+            case '\b': lbuf_write(b, "\\b", 2); break;
+            case '\f': lbuf_write(b, "\\f", 2); break;
+            case '\n': lbuf_write(b, "\\n", 2); break;
+            case '\r': lbuf_write(b, "\\r", 2); break;
+            case '\t': lbuf_write(b, "\\t", 2); break;
+            case '\v': lbuf_write(b, "\\v", 2); break;
+            case '\\': lbuf_write(b, "\\\\", 2); break;
+            case '\'': lbuf_write(b, "\\'", 2); break;
+            case '"': lbuf_write(b, "\\\"", 2); break;
+            default: lbuf_putc(b, *p); break;
+        }
+    }
+    lbuf_putc(b, '"');
+}
+
+//Serialize v if it has no children, otherwise open it and queue it
+void lbuf_enter(lbuf* b, lwork* w, lval* v)
+{
+    switch(v->type)
+    {
+        case LVAL_NUM:
+            lbuf_num(b, v->num);
+            break;
+        case LVAL_ERR:
+            lbuf_puts(b, "Error: ");
+            lbuf_puts(b, lval_err_msg(v));
+            break;
+        case LVAL_SYM:
+            lbuf_puts(b, v->sym);
+            break;
+        case LVAL_SEXPR:
+            lbuf_putc(b, '(');
+            lwork_push(w, v, NULL);
+            break;
+        case LVAL_QEXPR:
+            lbuf_putc(b, '{');
+            lwork_push(w, v, NULL);
+            break;
+        case LVAL_FUN:
+            if(v->builtin)
+            {
+                lbuf_puts(b, "<builtin>");
+            }
+            else
+            {
+                lbuf_puts(b, "(\\ ");
+                lwork_push(w, v, NULL);
+            }
+            break;
+        case LVAL_STR:
+            lbuf_str(b, v->str);
+            break;
+        case LVAL_SEQ:
+            lbuf_puts(b, "<sequence>");
+            break;
+        case LVAL_CHAN:
+            lbuf_puts(b, "<channel>");
+            break;
+        case LVAL_REC:
+            //(name slots...), the constructor call that makes it
+            lbuf_putc(b, '(');
+            lbuf_puts(b, v->rec->type->name);
+            lwork_push(w, v, NULL);
+            break;
+    }
+}
+
+//Lisp value serialize
+void lbuf_lval(lbuf* b, lval* v)
+{
+    lwork w;
+    lwork_init(&w);
+    lbuf_enter(b, &w, v);
+    while(w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        lval* x=p->v;
+        int i=p->i++;
+        if(x->type==LVAL_FUN)
+        {
+            //(\ formals body)
+            switch(i)
+            {
+                case 0:
+                    lbuf_enter(b, &w, x->formals);
+                    break;
+                case 1:
+                    lbuf_putc(b, ' ');
+                    lbuf_enter(b, &w, x->body);
+                    break;
+                default:
+                    lbuf_putc(b, ')');
+                    w.count--;
+                    break;
+            }
+        }
+        else if(x->type==LVAL_REC)
+        {
+            if(i<x->rec->count)
+            {
+                lbuf_putc(b, ' ');
+                lbuf_enter(b, &w, x->rec->slots[i]);
+            }
+            else
+            {
+                lbuf_putc(b, ')');
+                w.count--;
+            }
+        }
+        else if(i<x->count)
+        {
+            if(i>0)
+            {
+                lbuf_putc(b, ' ');
+            }
+            lbuf_enter(b, &w, x->cell[i]);
+        }
+        else
+        {
+            lbuf_putc(b, x->type==LVAL_SEXPR ? ')' : '}');
+            w.count--;
+        }
+    }
+    lwork_free(&w);
+}
+
+//Write the buffer to the current output and release it
+void lbuf_flush(lbuf* b)
+{
+    fwrite(b->data, 1, b->len, lval_out());
+    free(b->data);
+}
+
+//Lisp value print
+void lval_print(lval* v)
+{
+    lbuf b={NULL, 0, 0};
+    lbuf_lval(&b, v);
+    lbuf_flush(&b);
+}
+
+lval* lval_read_str(mpc_ast_t* t)
+{
+    t->contents[strlen(t->contents)-1]='\0';
+    char* unescaped=malloc(strlen(t->contents+1)+1);
+    strcpy(unescaped, t->contents+1);
+    unescaped=mpcf_unescape(unescaped);
+    lval* str=lval_str(unescaped);
+    free(unescaped);
+    return str;
+}
+
+void lval_print_str(lval* v)
+{
+    lbuf b={NULL, 0, 0};
+    lbuf_str(&b, v->str);
+    lbuf_flush(&b);
+}
+
+void lval_println(lval* v)
+{
+    lbuf b={NULL, 0, 0};
+    lbuf_lval(&b, v);
+    lbuf_putc(&b, '\n');
+    lbuf_flush(&b);
+}
+
+//Children of v as the walkers see them: the cells of an expression, or
+//the formals and body of a lambda
+int lval_nkids(lval* v)
+{
+    switch(v->type)
+    {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            return v->count;
+        case LVAL_FUN:
+            return v->builtin ? 0 : 2;
+    }
+    return 0;
+}
+
+lval** lval_kid(lval* v, int i)
+{
+    if(v->type==LVAL_FUN)
+    {
+        return i==0 ? &v->formals : &v->body;
+    }
+    return &v->cell[i];
+}
+
+//Compare everything but the children of x and y
+int lval_eq_node(lval* x, lval* y)
+{
+    if(x->type != y->type)
+    {
+        return 0;
+    }
+    switch (x->type)
+    {
+        case LVAL_NUM:
+            return (x->num==y->num);
+        case LVAL_ERR:
+            return (strcmp(lval_err_msg(x), lval_err_msg(y))==0);
+        case LVAL_SYM:
+            return (strcmp(x->sym, y->sym)==0);
+        case LVAL_FUN:
+            return x->builtin==y->builtin && (!x->builtin || (x->rtype==y->rtype && (!x->rtype || x->kind==y->kind)));
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            return x->count==y->count;
+        case LVAL_STR:
+            return (strcmp(x->str, y->str)==0);
+        case LVAL_SEQ:
+            return x->seq==y->seq;
+        case LVAL_CHAN:
+            return x->chan==y->chan;
+        case LVAL_REC:
+            return x->rec->type==y->rec->type;
+    }
+    return 0;
+}
+
+//Children lval_eq compares. Copying and freeing leave the slots of a
+//record alone, as they belong to its shared payload.
+int lval_eq_nkids(lval* v)
+{
+    return v->type==LVAL_REC ? v->rec->count : lval_nkids(v);
+}
+
+lval* lval_eq_kid(lval* v, int i)
+{
+    return v->type==LVAL_REC ? v->rec->slots[i] : *lval_kid(v, i);
+}
+
+//Equal to
+int lval_eq(lval* x, lval* y)
+{
+    if(x->refs && y->refs)
+    {
+        return x==y;
+    }
+    if(!lval_eq_node(x, y))
+    {
+        return 0;
+    }
+    lwork w;
+    lwork_init(&w);
+    lwork_push(&w, x, y);
+    int eq=1;
+    while(eq && w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==lval_eq_nkids(p->v))
+        {
+            w.count--;
+            continue;
+        }
+        int i=p->i++;
+        x=lval_eq_kid(p->v, i);
+        y=lval_eq_kid(p->w, i);
+        if(x->refs && y->refs)
+        {
+            eq=(x==y);
+            continue;
+        }
+        eq=lval_eq_node(x, y);
+        if(eq && lval_eq_nkids(x))
+        {
+            lwork_push(&w, x, y);
+        }
+    }
+    lwork_free(&w);
+    return eq;
+}
+
+//Copy everything but the children of v. Expressions get a cell array of
+//the right size for the caller to fill in.
+lval* lval_copy_node(lval* v)
+{
+    lval* x=lval_new(v->type);
+    switch(v->type)
+    {
+        case LVAL_FUN: 
+            if(v->builtin)
+            {
+                x->builtin=v->builtin;
+                x->macro=FALSE;
+                x->desc=v->desc;
+                x->rtype=v->rtype;
+                if(x->rtype)
+                {
+                    x->kind=v->kind;
+                    __atomic_add_fetch(&x->rtype->refs, 1, __ATOMIC_ACQ_REL);
+                }
+            }
+            else
+            {
+                x->builtin=NULL;
+                x->env=lenv_copy(v->env);
+                x->jit=v->jit;
+                x->fold=v->fold;
+                if(x->fold)
+                {
+                    __atomic_add_fetch(&x->fold->refs, 1, __ATOMIC_ACQ_REL);
+                }
+                x->macro=v->macro;
+            }
+            break;
+        case LVAL_NUM: 
+            x->num = v->num; 
+            break;
+        case LVAL_ERR:
+            x->code=v->code;
+            x->errfmt=NULL;
+            x->err=malloc(strlen(lval_err_msg(v))+1);
+            strcpy(x->err, v->err);
+            break;
+        case LVAL_SYM:
+            x->sym=lheap_alloc(strlen(v->sym)+1);
+            strcpy(x->sym, v->sym);
+            x->cache=v->cache;
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->count=v->count;
+            x->cell=lheap_alloc(sizeof(lval*) * x->count);
+            break;
+        case LVAL_STR:
+            x->str=lheap_alloc(strlen(v->str)+1);
+            strcpy(x->str, v->str);
+            break;
+        case LVAL_SEQ:
+            x->seq=v->seq;
+            __atomic_add_fetch(&x->seq->refs, 1, __ATOMIC_ACQ_REL);
+            break;
+        case LVAL_CHAN:
+            x->chan=v->chan;
+            __atomic_add_fetch(&x->chan->refs, 1, __ATOMIC_ACQ_REL);
+            break;
+        case LVAL_REC:
+            x->rec=v->rec;
+            __atomic_add_fetch(&x->rec->refs, 1, __ATOMIC_ACQ_REL);
+            break;
+    }
+    return x;
+}
+
+lval* lval_copy(lval* v)
+{
+    if(v->refs)
+    {
+        __atomic_add_fetch(&v->refs, 1, __ATOMIC_ACQ_REL);
+        return v;
+    }
+    lval* root=lval_copy_node(v);
+    if(!lval_nkids(v))
+    {
+        return root;
+    }
+    lwork w;
+    lwork_init(&w);
+    lwork_push(&w, v, root);
+    while(w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==lval_nkids(p->v))
+        {
+            w.count--;
+            continue;
+        }
+        int i=p->i++;
+        lval* from=*lval_kid(p->v, i);
+        if(from->refs)
+        {
+            __atomic_add_fetch(&from->refs, 1, __ATOMIC_ACQ_REL);
+            *lval_kid(p->w, i)=from;
+            continue;
+        }
+        lval* x=lval_copy_node(from);
+        *lval_kid(p->w, i)=x;
+        if(lval_nkids(from))
+        {
+            lwork_push(&w, from, x);
+        }
+    }
+    lwork_free(&w);
+    return root;
+}
+
+//Free everything v owns apart from its children
+void lval_del_node(lval* v)
+{
+    switch(v->type)
+    {
+        case LVAL_NUM:
+            break;
+        case LVAL_ERR:
+            free(v->err); //free allocated string
+            if(v->errfmt)
+            {
+                lerrfmt_del(v->errfmt);
+            }
+            break;
+        case LVAL_SYM:
+            lheap_free(v->sym); //free allocated string
+            break;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            lheap_free(v->cell);
+            break;
+        case LVAL_FUN:
+            if(!v->builtin)
+            {
+                lenv_del(v->env);
+                if(v->fold)
+                {
+                    lfold_del(v->fold);
+                }
+            }
+            else if(v->rtype)
+            {
+                lrtype_del(v->rtype);
+            }
+            break;
+        case LVAL_STR:
+            lheap_free(v->str);
+            break;
+        case LVAL_SEQ:
+            lseq_del(v->seq);
+            break;
+        case LVAL_CHAN:
+            lchan_del(v->chan);
+            break;
+        case LVAL_REC:
+            lrec_del(v->rec);
+            break;
+    }
+    if(nisp_ctx)
+    {
+        nisp_ctx->stats.frees++;
+        nisp_ctx->stats.bytes-=sizeof(lval);
+    }
+    free(v);
+}
+
+//delete lval, children first
+void lval_del(lval* v)
+{
+    if(v->refs && !lhc_release(v))
+    {
+        return;
+    }
+    if(!lval_nkids(v))
+    {
+        lval_del_node(v);
+        return;
+    }
+    lwork w;
+    lwork_init(&w);
+    lwork_push(&w, v, NULL);
+    while(w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==lval_nkids(p->v))
+        {
+            lval_del_node(p->v);
+            w.count--;
+            continue;
+        }
+        lval* x=*lval_kid(p->v, p->i++);
+        if(x->refs && !lhc_release(x))
+        {
+            continue;
+        }
+        if(lval_nkids(x))
+        {
+            lwork_push(&w, x, NULL);
+        }
+        else
+        {
+            lval_del_node(x);
+        }
+    }
+    lwork_free(&w);
+}
+
+lval* lval_lambda(lval* formals, lval* body)
+{
+    lval* v=lval_new(LVAL_FUN);
+    v->builtin=NULL;
+    v->env=lenv_new();
+    v->formals=formals;
+    v->body=body;
+    v->jit=NULL;
+    v->fold=NULL;
+    v->macro=FALSE;
+    return v;
+}
+
+//Function type creation
+lval* lval_fun(lbuiltin func)
+{
+    lval* v=lval_new(LVAL_FUN);
+    v->builtin = func;
+    v->macro=FALSE;
+    v->rtype=NULL;
+    v->desc=NULL;
+    return v;
+}
+
+//Number type creation
+lval* lval_num(double x)
+{
+    lval* v=lval_new(LVAL_NUM);
+    v->num=x;
+    return v;
+}
+
+//Error type creation. Most errors are discarded or caught without being
+//printed, so only the arguments are captured here and the message is
+//formatted by lval_err_msg when something reads it. fmt must be a literal.
+lval* lval_verr(int code, char* fmt, va_list va)
+{
+    lval* v=lval_new(LVAL_ERR);
+    v->code=code;
+    v->err=NULL;
+    lerrfmt* f=malloc(sizeof(lerrfmt));
+    f->fmt=fmt;
+    f->count=0;
+    for(char* p=fmt; *p; p++)
+    {
+        if(*p!='%')
+        {
+            continue;
+        }
+        p+=strspn(p+1, LERR_FLAGS)+1;
+        if(*p=='\0')
+        {
+            break;
+        }
+        if(*p=='%' || f->count==LERR_MAX_ARGS)
+        {
+            continue;
+        }
+        if(*p=='s')
+        {
+            char* s=va_arg(va, char*);
+            f->args[f->count].s=malloc(strlen(s)+1);
+            strcpy(f->args[f->count].s, s);
+        }
+        else if(*p=='f' || *p=='g' || *p=='e')
+        {
+            f->args[f->count].d=va_arg(va, double);
+        }
+        else
+        {
+            f->args[f->count].i=va_arg(va, int);
+        }
+        f->types[f->count++]=*p;
+    }
+    v->errfmt=f;
+    return v;
+}
+
+lval* lval_errc(int code, char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    lval* v=lval_verr(code, fmt, va);
+    va_end(va);
+    return v;
+}
+
+lval* lval_err(char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    lval* v=lval_verr(LERR_ERROR, fmt, va);
+    va_end(va);
+    return v;
+}
+
+void lerrfmt_del(lerrfmt* f)
+{
+    for(int i=0; i<f->count; i++)
+    {
+        if(f->types[i]=='s')
+        {
+            free(f->args[i].s);
+        }
+    }
+    free(f);
+}
+
+//Format an error's message on first use
+char* lval_err_msg(lval* v)
+{
+    if(v->err)
+    {
+        return v->err;
+    }
+    lerrfmt* f=v->errfmt;
+    size_t len;
+    FILE* out=open_memstream(&v->err, &len);
+    int n=0;
+    for(char* p=f->fmt; *p; p++)
+    {
+        if(*p!='%')
+        {
+            fputc(*p, out);
+            continue;
+        }
+        //Format one conversion at a time with its own spec
+        char spec[16];
+        int k=strspn(p+1, LERR_FLAGS)+1;
+        if(p[k]=='\0' || k>13)
+        {
+            break;
+        }
+        memcpy(spec, p, k+1);
+        spec[k+1]='\0';
+        p+=k;
+        if(*p=='%' || n==f->count)
+        {
+            fputc('%', out);
+            continue;
+        }
+        switch(f->types[n])
+        {
+            case 's': fprintf(out, spec, f->args[n].s); break;
+            case 'f': case 'g': case 'e': fprintf(out, spec, f->args[n].d); break;
+            default: fprintf(out, spec, f->args[n].i); break;
+        }
+        n++;
+    }
+    fclose(out);
+    lerrfmt_del(f);
+    v->errfmt=NULL;
+    return v->err;
+}
+
+//Symbol type creation
+lval* lval_sym(char* s)
+{
+    lval* v=lval_new(LVAL_SYM);
+    v->sym=lheap_alloc(strlen(s)+1);
+    strcpy(v->sym, s);
+    v->cache=nisp_ctx ? lsym_intern(nisp_ctx->syms, s) : NULL;
+    return v;
+}
+
+//String type creation
+lval* lval_str(char* s)
+{
+    lval* v=lval_new(LVAL_STR);
+    v->str=lheap_alloc(strlen(s)+1);
+    strcpy(v->str, s);
+    return v;
+}
+
+lval* lval_builtin(lbuiltin func)
+{
+    lval* v=lval_new(LVAL_FUN);
+    v->builtin=func;
+    v->macro=FALSE;
+    v->rtype=NULL;
+    v->desc=NULL;
+    return v;
+}
+
+//S-Expression creation
+lval* lval_sexpr(void)
+{
+    lval* v=lval_new(LVAL_SEXPR);
+    v->count=0;
+    v->cell=NULL;
+    return v;
+}
+
+//Q-Expression creation
+lval* lval_qexpr(void)
+{
+    lval* v=lval_new(LVAL_QEXPR);
+    v->count=0;
+    v->cell=NULL;
+    return v;
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v)
+{
+    //Stop at the first error, the rest is never evaluated
+    for(int i=0;i<v->count;i++)
+    {
+        v->cell[i]=lval_eval(e, v->cell[i]);
+        if(v->cell[i]->type==LVAL_ERR)
+        {
+            return lval_take(v,i);
+        }
+        //Macro arguments are passed unevaluated, and the expansion run
+        if(i==0 && v->count>1 && v->cell[0]->type==LVAL_FUN && v->cell[0]->macro)
+        {
+            lval* x=lmacro_expand(v->cell[0], v);
+            lval_del(v);
+            return lval_eval(e, x);
+        }
+    }
+    if(v->count==0)
+    {
+        return v;
+    }
+    if(v->count==1)
+    {
+        return lval_eval(e, lval_take(v,0));
+    }
+    lval* f=lval_pop(v,0);
+    if(f->type!=LVAL_FUN)
+    {
+        lval* err=lval_errc(LERR_TYPE, "S-Expression begins with invalid type.\n" "Received: %s\nExpected: %s", ltype_name(f->type), ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+        return err;
+    }
+    lval* result=lval_call(e, f, v);
+    lval_del(f);
+    return result;
+}
+
+/************************************************************
+**************************MACROS*****************************
+************************************************************/
+
+#define LMACRO_DEPTH 64
+
+//Formals of a macro are split into fixed ones and an optional '&' rest
+int lmacro_fixed(lval* m)
+{
+    int n=0;
+    while(n<m->formals->count && strcmp(m->formals->cell[n]->sym, "&")!=0)
+    {
+        n++;
+    }
+    return n;
+}
+
+//Copy the template t, replacing each formal with its unevaluated argument.
+//The rest formal is spliced in place when it is an element of a list.
+lval* lmacro_subst(lval* m, lval* a, lval* t)
+{
+    int fixed=lmacro_fixed(m);
+    char* rest=fixed+1 < m->formals->count ? m->formals->cell[fixed+1]->sym : NULL;
+    if(t->type==LVAL_SYM)
+    {
+        for(int i=0; i<fixed; i++)
+        {
+            if(strcmp(m->formals->cell[i]->sym, t->sym)==0)
+            {
+                return lval_copy(a->cell[i]);
+            }
+        }
+        if(rest && strcmp(rest, t->sym)==0)
+        {
+            lval* x=lval_qexpr();
+            for(int i=fixed; i<a->count; i++)
+            {
+                x=lval_add(x, lval_copy(a->cell[i]));
+            }
+            return x;
+        }
+        return lval_copy(t);
+    }
+    if(t->type!=LVAL_SEXPR && t->type!=LVAL_QEXPR)
+    {
+        return lval_copy(t);
+    }
+    lval* x=t->type==LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    for(int i=0; i<t->count; i++)
+    {
+        if(rest && t->cell[i]->type==LVAL_SYM && strcmp(rest, t->cell[i]->sym)==0)
+        {
+            for(int j=fixed; j<a->count; j++)
+            {
+                x=lval_add(x, lval_copy(a->cell[j]));
+            }
+            continue;
+        }
+        x=lval_add(x, lmacro_subst(m, a, t->cell[i]));
+    }
+    return x;
+}
+
+//Expand the call v, whose first element names the macro m, into code
+lval* lmacro_expand(lval* m, lval* v)
+{
+    int fixed=lmacro_fixed(m);
+    int given=v->count-1;
+    if(fixed==m->formals->count ? given!=fixed : given<fixed)
+    {
+        return lval_errc(LERR_ARGS, "Macro passed wrong number of arguments.\nGot %i\nExpected %i\n", given, fixed);
+    }
+    lval* a=lval_copy(v);
+    lval_del(lval_pop(a, 0));
+    lval* x=lval_own(lmacro_subst(m, a, m->body));
+    lval_del(a);
+    x->type=LVAL_SEXPR;
+    return x;
+}
+
+//defmacro {name formals...} {template}
+lval* builtin_defmacro(lenv* e, lval* a)
+{
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("defmacro", a, 0);
+    for(int i=0; i<a->cell[0]->count; i++)
+    {
+        LASSERT_CODE(a, a->cell[0]->cell[i]->type==LVAL_SYM, LERR_TYPE, "Cannot define non-symbolic object.\nRecieved: %s\nExpected: %s", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+    lval* formals=lval_pop(a, 0);
+    lval* name=lval_pop(formals, 0);
+    lval* m=lval_lambda(formals, lval_pop(a, 0));
+    m->macro=TRUE;
+    lenv_def(e, name, m);
+    lval_del(name);
+    lval_del(m);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/************************************************************
+************************OPTIMIZER****************************
+************************************************************/
+
+//Optimization level, -O0 turns off folding of lambda bodies and expanding
+//the macros in them
+int nisp_opt=1;
+
+//Builtins that always give the same result for the same constant args
+int lbuiltin_pure(lbuiltin f)
+{
+    const lbdesc* d=lbdesc_find(f);
+    return d && d->pure;
+}
+
+void lfold_del(lfold* d)
+{
+    if(__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL)==0)
+    {
+        lval_del(d->body);
+        free(d->deps);
+        free(d->gens);
+        free(d);
+    }
+}
+
+int lfold_valid(lfold* d)
+{
+    for(int i=0; i<d->ndeps; i++)
+    {
+        if(d->deps[i]->local || d->deps[i]->gen!=d->gens[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+//Body a call of the lambda f runs
+lval* lval_body(lval* f)
+{
+    return (f->fold && lfold_valid(f->fold)) ? f->fold->body : f->body;
+}
+
+//Find the builtin or macro a symbol in a lambda body refers to, recording
+//it as a dependency of the fold. NULL if it is a parameter of the lambda,
+//could be bound locally when the body runs, or is not bound globally to a
+//builtin or macro.
+lval* lval_fold_lookup(lenv* e, lval* formals, lfold* d, lval* sym)
+{
+    for(int i=0; i<formals->count; i++)
+    {
+        if(strcmp(formals->cell[i]->sym, sym->sym)==0)
+        {
+            return NULL;
+        }
+    }
+    lsym* c=sym->cache;
+    if(!c || c->local || !nisp_ctx)
+    {
+        return NULL;
+    }
+    while(e->par)
+    {
+        e=e->par;
+    }
+    if(e!=nisp_ctx->env)
+    {
+        return NULL;
+    }
+    for(int i=0; i<e->count; i++)
+    {
+        if(strcmp(e->syms[i], sym->sym)==0)
+        {
+            lval* f=e->vals[i];
+            if(f->type!=LVAL_FUN || (!f->builtin && !f->macro))
+            {
+                return NULL;
+            }
+            int known=FALSE;
+            for(int j=0; j<d->ndeps && !known; j++)
+            {
+                known=(d->deps[j]==c);
+            }
+            if(!known)
+            {
+                d->deps=realloc(d->deps, sizeof(lsym*) * (d->ndeps+1));
+                d->gens=realloc(d->gens, sizeof(long) * (d->ndeps+1));
+                d->deps[d->ndeps]=c;
+                d->gens[d->ndeps++]=c->gen;
+            }
+            return f;
+        }
+    }
+    return NULL;
+}
+
+lbuiltin lval_fold_builtin(lenv* e, lval* formals, lfold* d, lval* sym)
+{
+    lval* f=lval_fold_lookup(e, formals, d, sym);
+    return f ? f->builtin : NULL;
+}
+
+lval* lval_fold(lenv* e, lval* formals, lfold* d, lval* v);
+lfold* lfold_new(lenv* e, lval* formals, lval* body);
+
+//Fold an if branch, loop body or lambda body, which are code even though they are
+//Q-Expressions
+lval* lval_fold_branch(lenv* e, lval* formals, lfold* d, lval* v)
+{
+    if(v->type!=LVAL_QEXPR)
+    {
+        return v;
+    }
+    v=lval_own(v);
+    v->type=LVAL_SEXPR;
+    v=lval_fold(e, formals, d, v);
+    if(v->type==LVAL_SEXPR)
+    {
+        v->type=LVAL_QEXPR;
+        return v;
+    }
+    return lval_add(lval_qexpr(), v);
+}
+
+//Fold an S-Expression in code position. Macro calls are expanded, calls
+//to pure builtins with constant arguments are replaced by their result,
+//and an if with a constant condition by the branch it takes. The branches
+//of an if, the bodies of loops, try and eval are folded too, and nested
+//lambdas made with their bodies folded, so macros in them are expanded
+//once rather than on every run. Q-Expressions anywhere else are data and
+//are left alone.
+lval* lval_fold(lenv* e, lval* formals, lfold* d, lval* v)
+{
+    //Bounded, so a macro that expands to itself can't loop forever
+    for(int n=0; n<LMACRO_DEPTH && v->type==LVAL_SEXPR && v->count>1 && v->cell[0]->type==LVAL_SYM; n++)
+    {
+        lval* m=lval_fold_lookup(e, formals, d, v->cell[0]);
+        if(!m || !m->macro)
+        {
+            break;
+        }
+        lval* x=lmacro_expand(m, v);
+        if(x->type==LVAL_ERR)
+        {
+            //Leave the call to fail the same way at run time
+            lval_del(x);
+            break;
+        }
+        lval_del(v);
+        v=x;
+    }
+    if(v->type!=LVAL_SEXPR)
+    {
+        return v;
+    }
+    v=lval_own(v);
+    for(int i=0; i<v->count; i++)
+    {
+        v->cell[i]=lval_fold(e, formals, d, v->cell[i]);
+    }
+    if(v->count==0 || v->cell[0]->type!=LVAL_SYM)
+    {
+        return v;
+    }
+    lbuiltin f=lval_fold_builtin(e, formals, d, v->cell[0]);
+    if(f==builtin_if && v->count==4)
+    {
+        v->cell[2]=lval_fold_branch(e, formals, d, v->cell[2]);
+        v->cell[3]=lval_fold_branch(e, formals, d, v->cell[3]);
+        if(v->cell[1]->type!=LVAL_NUM || v->cell[2]->type!=LVAL_QEXPR || v->cell[3]->type!=LVAL_QEXPR)
+        {
+            return v;
+        }
+        lval* x=lval_take(v, v->cell[1]->num ? 2 : 3);
+        x->type=LVAL_SEXPR;
+        //(x) evaluates the same as x, so unwrap single expressions
+        return x->count==1 ? lval_take(x, 0) : x;
+    }
+    if((f==builtin_while || f==builtin_dotimes || f==builtin_loop) && v->count==3)
+    {
+        if(f==builtin_while)
+        {
+            v->cell[1]=lval_fold_branch(e, formals, d, v->cell[1]);
+        }
+        v->cell[2]=lval_fold_branch(e, formals, d, v->cell[2]);
+        return v;
+    }
+    if((f==builtin_try && v->count==3) || (f==builtin_eval && v->count==2))
+    {
+        for(int i=1; i<v->count; i++)
+        {
+            v->cell[i]=lval_fold_branch(e, formals, d, v->cell[i]);
+        }
+        return v;
+    }
+    if(f==builtin_lambda && v->count==3 && v->cell[1]->type==LVAL_QEXPR && v->cell[2]->type==LVAL_QEXPR)
+    {
+        //Made here rather than each time the code runs, folded once. Its
+        //parameters shadow whatever they name in its body.
+        lval* inner=lval_qexpr();
+        for(int i=0; i<formals->count; i++)
+        {
+            inner=lval_add(inner, lval_copy(formals->cell[i]));
+        }
+        for(int i=0; i<v->cell[1]->count; i++)
+        {
+            if(v->cell[1]->cell[i]->type!=LVAL_SYM)
+            {
+                lval_del(inner);
+                return v;
+            }
+            inner=lval_add(inner, lval_copy(v->cell[1]->cell[i]));
+        }
+        lval* x=lval_pop(v, 1);
+        x=lval_lambda(x, lval_pop(v, 1));
+        x->fold=lfold_new(e, inner, x->body);
+        lval_del(inner);
+        lval_del(v);
+        return x;
+    }
+    if(!f || !lbuiltin_pure(f))
+    {
+        return v;
+    }
+    for(int i=1; i<v->count; i++)
+    {
+        int t=v->cell[i]->type;
+        if(t!=LVAL_NUM && t!=LVAL_STR && t!=LVAL_QEXPR)
+        {
+            return v;
+        }
+    }
+    lval* a=lval_copy(v);
+    lval_del(lval_pop(a, 0));
+    lval* x=f(e, a);
+    //Leave errors such as division by zero to be raised at run time
+    if(x->type==LVAL_ERR)
+    {
+        lval_del(x);
+        return v;
+    }
+    lval_del(v);
+    return x;
+}
+
+//Fold the body of a new lambda, NULL if that changes nothing or with -O0,
+//where macros are only expanded as calls to them run
+lfold* lfold_new(lenv* e, lval* formals, lval* body)
+{
+    if(!nisp_opt)
+    {
+        return NULL;
+    }
+    lfold* d=calloc(1, sizeof(lfold));
+    d->refs=1;
+    d->body=lval_fold_branch(e, formals, d, lval_copy(body));
+    if(lval_eq(d->body, body))
+    {
+        lfold_del(d);
+        return NULL;
+    }
+    return d;
+}
+
+/************************************************************
+***************************JIT*******************************
+************************************************************/
+
+//--jit compiles lambdas whose bodies only use their parameters, numbers,
+//arithmetic and comparison builtins, if, and calls to other compiled
+//lambdas, into x86-64 code working on unboxed doubles. Compiled code is
+//int f(double* args, double* result), returning 0 to bail out to the
+//interpreter, which then redoes the call and raises any error itself.
+
+struct ljit
+{
+    unsigned char* code;
+    size_t size;
+    int argc;
+    //Globals the code was compiled against, with their generations. The
+    //code is only valid while none were redefined or bound locally.
+    int ndeps;
+    lsym** deps;
+    long* gens;
+    ljit* next;
+};
+
+int ljit_valid(ljit* j)
+{
+    for(int i=0; i<j->ndeps; i++)
+    {
+        if(j->deps[i]->local || j->deps[i]->gen!=j->gens[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void ljit_del(ljit* j)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    //Code from nisp --compile is part of the program, not mapped
+    if(j->size)
+    {
+        munmap(j->code, j->size);
+    }
+#endif
+    free(j->deps);
+    free(j->gens);
+    free(j);
+}
+
+//Run compiled code for a call where every argument is a number. Returns
+//NULL when the call has to go through the interpreter instead.
+lval* ljit_call(ljit* j, lval* a)
+{
+    if(a->count!=j->argc || !ljit_valid(j))
+    {
+        return NULL;
+    }
+    double args[j->argc+1];
+    for(int i=0; i<a->count; i++)
+    {
+        if(a->cell[i]->type!=LVAL_NUM)
+        {
+            return NULL;
+        }
+        args[i]=a->cell[i]->num;
+    }
+    double r;
+    if(!((int(*)(double*, double*)) j->code)(args, &r))
+    {
+        nisp_ctx->stats.jit_bails++;
+        return NULL;
+    }
+    nisp_ctx->stats.jit_calls++;
+    lval_del(a);
+    return lval_num(r);
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+//Code being generated. Temporaries live on the machine stack below rbx and
+//r12, depth counts them so every slot has a fixed offset from rbp.
+typedef struct
+{
+    unsigned char* buf;
+    size_t len;
+    size_t cap;
+    lenv* env;
+    lsym* self;
+    lval* formals;
+    ljit* jit;
+    int depth;
+    size_t* bails; //rel32 fields that jump to the bail-out
+    int nbails;
+} lasm;
+
+void lasm_bytes(lasm* s, int n, ...)
+{
+    va_list va;
+    va_start(va, n);
+    if(s->len+n > s->cap)
+    {
+        s->cap=s->cap*2+n+64;
+        s->buf=realloc(s->buf, s->cap);
+    }
+    for(int i=0; i<n; i++)
+    {
+        s->buf[s->len++]=(unsigned char) va_arg(va, int);
+    }
+    va_end(va);
+}
+
+void lasm_imm(lasm* s, void* p, int n)
+{
+    unsigned char* b=p;
+    for(int i=0; i<n; i++)
+    {
+        lasm_bytes(s, 1, b[i]);
+    }
+}
+
+void lasm_i32(lasm* s, int x)
+{
+    lasm_imm(s, &x, 4);
+}
+
+//Emit a jump/call opcode with a rel32 to be patched, returns its offset
+size_t lasm_rel(lasm* s, int n, ...)
+{
+    va_list va;
+    va_start(va, n);
+    for(int i=0; i<n; i++)
+    {
+        lasm_bytes(s, 1, va_arg(va, int));
+    }
+    va_end(va);
+    lasm_i32(s, 0);
+    return s->len-4;
+}
+
+void lasm_patch(lasm* s, size_t at, size_t target)
+{
+    int rel=(int) (target-(at+4));
+    memcpy(s->buf+at, &rel, 4);
+}
+
+void lasm_bail_if(lasm* s, int cc)
+{
+    s->bails=realloc(s->bails, sizeof(size_t) * (s->nbails+1));
+    s->bails[s->nbails++]=lasm_rel(s, 2, 0x0F, cc);
+}
+
+int lasm_rbp(lasm* s)
+{
+    return -16-8*s->depth;
+}
+
+//push xmm0
+void lasm_push(lasm* s)
+{
+    lasm_bytes(s, 7, 0x48, 0x83, 0xEC, 0x08, 0xF2, 0x0F, 0x11); //sub rsp,8; movsd [rsp],xmm0
+    lasm_bytes(s, 2, 0x04, 0x24);
+    s->depth++;
+}
+
+//pop xmm1
+void lasm_pop(lasm* s)
+{
+    lasm_bytes(s, 5, 0xF2, 0x0F, 0x10, 0x0C, 0x24); //movsd xmm1,[rsp]
+    lasm_bytes(s, 4, 0x48, 0x83, 0xC4, 0x08); //add rsp,8
+    s->depth--;
+}
+
+//Look up what a non-parameter symbol is bound to globally, recording it as
+//a dependency of the code
+lval* lasm_global(lasm* s, lval* sym)
+{
+    lsym* c=sym->cache;
+    if(!c || c->local)
+    {
+        return NULL;
+    }
+    for(int i=0; i<s->env->count; i++)
+    {
+        if(strcmp(s->env->syms[i], sym->sym)==0)
+        {
+            ljit* j=s->jit;
+            j->deps=realloc(j->deps, sizeof(lsym*) * (j->ndeps+1));
+            j->gens=realloc(j->gens, sizeof(long) * (j->ndeps+1));
+            j->deps[j->ndeps]=c;
+            j->gens[j->ndeps++]=c->gen;
+            return s->env->vals[i];
+        }
+    }
+    return NULL;
+}
+
+int lasm_expr(lasm* s, lval* v);
+
+//Compile the elements of an S-Expression, as a body or if branch would be
+//evaluated, leaving the value in xmm0
+int lasm_sexpr(lasm* s, lval* v)
+{
+    if(v->count==1)
+    {
+        return lasm_expr(s, v->cell[0]);
+    }
+    if(v->count<2 || v->cell[0]->type!=LVAL_SYM)
+    {
+        return FALSE;
+    }
+    for(int i=0; i<s->formals->count; i++)
+    {
+        if(strcmp(s->formals->cell[i]->sym, v->cell[0]->sym)==0)
+        {
+            return FALSE;
+        }
+    }
+    lval* f=lasm_global(s, v->cell[0]);
+    if(!f || f->type!=LVAL_FUN)
+    {
+        return FALSE;
+    }
+    lbuiltin b=f->builtin;
+    int argc=v->count-1;
+
+    if(b==builtin_if)
+    {
+        if(argc!=3 || v->cell[2]->type!=LVAL_QEXPR || v->cell[3]->type!=LVAL_QEXPR || !lasm_expr(s, v->cell[1]))
+        {
+            return FALSE;
+        }
+        lasm_bytes(s, 8, 0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xC2); //xorpd xmm2,xmm2; ucomisd xmm0,xmm2
+        size_t t1=lasm_rel(s, 2, 0x0F, 0x85); //jne
+        size_t t2=lasm_rel(s, 2, 0x0F, 0x8A); //jp
+        if(!lasm_sexpr(s, v->cell[3]))
+        {
+            return FALSE;
+        }
+        size_t end=lasm_rel(s, 1, 0xE9);
+        lasm_patch(s, t1, s->len);
+        lasm_patch(s, t2, s->len);
+        if(!lasm_sexpr(s, v->cell[2]))
+        {
+            return FALSE;
+        }
+        lasm_patch(s, end, s->len);
+        return TRUE;
+    }
+
+    if(b==builtin_add || b==builtin_sub || b==builtin_mul || b==builtin_div || b==builtin_pow)
+    {
+        if(!lasm_expr(s, v->cell[1]))
+        {
+            return FALSE;
+        }
+        for(int i=2; i<v->count; i++)
+        {
+            lasm_push(s);
+            if(!lasm_expr(s, v->cell[i]))
+            {
+                return FALSE;
+            }
+            lasm_pop(s);
+            if(b==builtin_add) { lasm_bytes(s, 4, 0xF2, 0x0F, 0x58, 0xC8); } //addsd xmm1,xmm0
+            if(b==builtin_sub) { lasm_bytes(s, 4, 0xF2, 0x0F, 0x5C, 0xC8); } //subsd xmm1,xmm0
+            if(b==builtin_mul) { lasm_bytes(s, 4, 0xF2, 0x0F, 0x59, 0xC8); } //mulsd xmm1,xmm0
+            if(b==builtin_div)
+            {
+                lasm_bytes(s, 8, 0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xC2); //xorpd xmm2,xmm2; ucomisd xmm0,xmm2
+                lasm_bail_if(s, 0x84); //je, the interpreter raises divide by zero
+                lasm_bytes(s, 4, 0xF2, 0x0F, 0x5E, 0xC8); //divsd xmm1,xmm0
+            }
+            if(b==builtin_pow)
+            {
+                //pow(xmm1, xmm0) through libm, with the stack 16 byte aligned
+                double (*p)(double, double)=pow;
+                lasm_bytes(s, 4, 0x66, 0x0F, 0x28, 0xD0); //movapd xmm2,xmm0
+                lasm_bytes(s, 4, 0x66, 0x0F, 0x28, 0xC1); //movapd xmm0,xmm1
+                lasm_bytes(s, 4, 0x66, 0x0F, 0x28, 0xCA); //movapd xmm1,xmm2
+                int pad=s->depth%2;
+                if(pad) { lasm_bytes(s, 4, 0x48, 0x83, 0xEC, 0x08); }
+                lasm_bytes(s, 2, 0x48, 0xB8); //mov rax,pow
+                lasm_imm(s, &p, 8);
+                lasm_bytes(s, 2, 0xFF, 0xD0); //call rax
+                if(pad) { lasm_bytes(s, 4, 0x48, 0x83, 0xC4, 0x08); }
+                continue;
+            }
+            lasm_bytes(s, 4, 0x66, 0x0F, 0x28, 0xC1); //movapd xmm0,xmm1
+        }
+        return TRUE;
+    }
+
+    if(b==builtin_gt || b==builtin_lt || b==builtin_ge || b==builtin_le || b==builtin_eq || b==builtin_ne)
+    {
+        if(argc!=2 || !lasm_expr(s, v->cell[1]))
+        {
+            return FALSE;
+        }
+        lasm_push(s);
+        if(!lasm_expr(s, v->cell[2]))
+        {
+            return FALSE;
+        }
+        lasm_pop(s);
+        //Operands are flipped for < and <= so NaN compares false as in C
+        int flip=(b==builtin_lt || b==builtin_le);
+        lasm_bytes(s, 4, 0x66, 0x0F, 0x2E, flip ? 0xC1 : 0xC8); //ucomisd
+        if(b==builtin_gt || b==builtin_lt) { lasm_bytes(s, 3, 0x0F, 0x97, 0xC0); } //seta al
+        if(b==builtin_ge || b==builtin_le) { lasm_bytes(s, 3, 0x0F, 0x93, 0xC0); } //setae al
+        if(b==builtin_eq) { lasm_bytes(s, 8, 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8); } //sete al; setnp cl; and al,cl
+        if(b==builtin_ne) { lasm_bytes(s, 8, 0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8); } //setne al; setp cl; or al,cl
+        lasm_bytes(s, 7, 0x0F, 0xB6, 0xC0, 0xF2, 0x0F, 0x2A, 0xC0); //movzx eax,al; cvtsi2sd xmm0,eax
+        return TRUE;
+    }
+
+    //Call to ourselves or another compiled lambda taking exactly argc args
+    int self=(v->cell[0]->cache==s->self);
+    if(b || (!self && (!f->jit || f->jit->argc!=argc)) || (self && s->formals->count!=argc))
+    {
+        return FALSE;
+    }
+    if(!self)
+    {
+        //Our code is only valid while the callee's is
+        ljit* j=s->jit;
+        j->deps=realloc(j->deps, sizeof(lsym*) * (j->ndeps+f->jit->ndeps));
+        j->gens=realloc(j->gens, sizeof(long) * (j->ndeps+f->jit->ndeps));
+        memcpy(j->deps+j->ndeps, f->jit->deps, sizeof(lsym*) * f->jit->ndeps);
+        memcpy(j->gens+j->ndeps, f->jit->gens, sizeof(long) * f->jit->ndeps);
+        j->ndeps+=f->jit->ndeps;
+    }
+    //Reserve the args and result, keeping the stack aligned at the call
+    int slots=argc+1;
+    slots+=(s->depth+slots)%2;
+    lasm_bytes(s, 3, 0x48, 0x81, 0xEC); //sub rsp,slots*8
+    lasm_i32(s, slots*8);
+    s->depth+=slots;
+    int base=lasm_rbp(s);
+    for(int i=0; i<argc; i++)
+    {
+        if(!lasm_expr(s, v->cell[i+1]))
+        {
+            return FALSE;
+        }
+        lasm_bytes(s, 4, 0xF2, 0x0F, 0x11, 0x85); //movsd [rbp+arg],xmm0
+        lasm_i32(s, base+8*i);
+    }
+    lasm_bytes(s, 3, 0x48, 0x8D, 0xBD); //lea rdi,[rbp+args]
+    lasm_i32(s, base);
+    lasm_bytes(s, 3, 0x48, 0x8D, 0xB5); //lea rsi,[rbp+result]
+    lasm_i32(s, base+8*argc);
+    if(self)
+    {
+        lasm_patch(s, lasm_rel(s, 1, 0xE8), 0); //call rel32 to our own entry
+    }
+    else
+    {
+        lasm_bytes(s, 2, 0x48, 0xB8); //mov rax,code
+        lasm_imm(s, &f->jit->code, 8);
+        lasm_bytes(s, 2, 0xFF, 0xD0); //call rax
+    }
+    lasm_bytes(s, 2, 0x85, 0xC0); //test eax,eax
+    lasm_bail_if(s, 0x84); //jz
+    lasm_bytes(s, 4, 0xF2, 0x0F, 0x10, 0x85); //movsd xmm0,[rbp+result]
+    lasm_i32(s, base+8*argc);
+    lasm_bytes(s, 3, 0x48, 0x81, 0xC4); //add rsp,slots*8
+    lasm_i32(s, slots*8);
+    s->depth-=slots;
+    return TRUE;
+}
+
+int lasm_expr(lasm* s, lval* v)
+{
+    if(v->type==LVAL_NUM)
+    {
+        lasm_bytes(s, 2, 0x48, 0xB8); //mov rax,num
+        lasm_imm(s, &v->num, 8);
+        lasm_bytes(s, 5, 0x66, 0x48, 0x0F, 0x6E, 0xC0); //movq xmm0,rax
+        return TRUE;
+    }
+    if(v->type==LVAL_SYM)
+    {
+        for(int i=0; i<s->formals->count; i++)
+        {
+            if(strcmp(s->formals->cell[i]->sym, v->sym)==0)
+            {
+                lasm_bytes(s, 4, 0xF2, 0x0F, 0x10, 0x83); //movsd xmm0,[rbx+arg]
+                lasm_i32(s, 8*i);
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    if(v->type==LVAL_SEXPR)
+    {
+        return lasm_sexpr(s, v);
+    }
+    return FALSE;
+}
+
+//Compile the lambda f, just bound globally to the symbol k
+ljit* ljit_compile(lval* k, lval* f)
+{
+    for(int i=0; i<f->formals->count; i++)
+    {
+        if(strcmp(f->formals->cell[i]->sym, "&")==0)
+        {
+            return NULL;
+        }
+    }
+    lasm s;
+    memset(&s, 0, sizeof(lasm));
+    s.env=nisp_ctx->env;
+    s.self=k->cache;
+    s.formals=f->formals;
+    s.jit=calloc(1, sizeof(ljit));
+    s.jit->argc=f->formals->count;
+    lasm_bytes(&s, 7, 0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54); //push rbp; mov rbp,rsp; push rbx; push r12
+    lasm_bytes(&s, 6, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4); //mov rbx,rdi; mov r12,rsi
+    lval* src=lval_body(f);
+    lval* body=lval_own(lval_copy(src));
+    if(src!=f->body)
+    {
+        //Code compiled from the folded body is only valid as long as it is
+        ljit* j=s.jit;
+        j->deps=malloc(sizeof(lsym*) * f->fold->ndeps);
+        j->gens=malloc(sizeof(long) * f->fold->ndeps);
+        memcpy(j->deps, f->fold->deps, sizeof(lsym*) * f->fold->ndeps);
+        memcpy(j->gens, f->fold->gens, sizeof(long) * f->fold->ndeps);
+        j->ndeps=f->fold->ndeps;
+    }
+    body->type=LVAL_SEXPR;
+    int ok=lasm_sexpr(&s, body);
+    lval_del(body);
+    if(ok)
+    {
+        lasm_bytes(&s, 6, 0xF2, 0x41, 0x0F, 0x11, 0x04, 0x24); //movsd [r12],xmm0
+        lasm_bytes(&s, 5, 0xB8, 0x01, 0x00, 0x00, 0x00); //mov eax,1
+        size_t done=lasm_rel(&s, 1, 0xE9);
+        for(int i=0; i<s.nbails; i++)
+        {
+            lasm_patch(&s, s.bails[i], s.len);
+        }
+        lasm_bytes(&s, 2, 0x31, 0xC0); //xor eax,eax
+        lasm_patch(&s, done, s.len);
+        lasm_bytes(&s, 9, 0x48, 0x8D, 0x65, 0xF0, 0x41, 0x5C, 0x5B, 0x5D, 0xC3); //lea rsp,[rbp-16]; pop r12; pop rbx; pop rbp; ret
+        s.jit->size=s.len;
+        s.jit->code=mmap(NULL, s.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ok=(s.jit->code!=MAP_FAILED);
+    }
+    if(ok)
+    {
+        memcpy(s.jit->code, s.buf, s.len);
+        mprotect(s.jit->code, s.len, PROT_READ | PROT_EXEC);
+        s.jit->next=nisp_ctx->jits;
+        nisp_ctx->jits=s.jit;
+    }
+    else
+    {
+        free(s.jit->deps);
+        free(s.jit->gens);
+        free(s.jit);
+        s.jit=NULL;
+    }
+    free(s.buf);
+    free(s.bails);
+    return s.jit;
+}
+
+#else
+
+ljit* ljit_compile(lval* k, lval* f)
+{
+    return NULL;
+}
+
+#endif
+
+lval* builtin_lambda(lenv* e, lval* a)
+{
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+    for(int i=0; i<a->cell[0]->count; i++)
+    {
+        LASSERT(a, a->cell[0]->cell[i]->type==LVAL_SYM, "Cannot define non-symbolic object.\nRecieved: %s\nExpected: %s", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+    lval* formals=lval_pop(a,0);
+    lval* body=lval_pop(a,0);
+    lval_del(a);
+    lval* f=lval_lambda(formals, body);
+    f->fold=lfold_new(e, formals, body);
+    return f;
+}
+
+//Count a step against the budget, TRUE once it is exhausted. Steps are
+//handed out in chunks, so the heap and clock are only looked at between them.
+int lbudget_check(lctx* c);
+
+int lbudget_spend(lctx* c)
+{
+    return --c->fuel < 0 && lbudget_check(c);
+}
+
+lval* lval_eval(lenv* e, lval* v)
+{
+    if(lbudget_spend(nisp_ctx))
+    {
+        lval_del(v);
+        return lbudget_err(nisp_ctx);
+    }
+    if(v->type==LVAL_SYM)
+    {
+        lval* x = lenv_get(e,v);
+        lval_del(v);
+        return x;
+    }
+    if(v->type==LVAL_SEXPR)
+    {
+        return lval_eval_sexpr(e, lval_own(v));
+    }
+    return v;
+}
+
+lval* lval_read_num(mpc_ast_t* t)
+{
+    errno=0;
+    double x=strtod(t->contents, NULL);
+    return errno!=ERANGE
+        ? lval_num(x)
+        : lval_err("Invalid number.");
+}
+
+lval* lval_read(mpc_ast_t* t)
+{
+    if(strstr(t->tag, "number"))
+    {
+        return lval_read_num(t);
+    }
+    if(strstr(t->tag, "symbol"))
+    {
+        return lval_sym(t->contents);
+    }
+    lval* x=NULL;
+    if(strcmp(t->tag, ">")==0)
+    {
+        x=lval_sexpr();
+    }
+    if(strstr(t->tag, "sexpr"))
+    {
+        x=lval_sexpr();
+    }
+    if(strstr(t->tag, "qexpr"))
+    {
+        x=lval_qexpr();
+    }
+    if(strstr(t->tag, "string"))
+    {
+        return lval_read_str(t);
+    }
+    for(int i=0; i<t->children_num; i++)
+    {
+        if(strcmp(t->children[i]->contents, "(")==0) {continue;}
+        if(strcmp(t->children[i]->contents, ")")==0) {continue;}
+        if(strcmp(t->children[i]->contents, "{")==0) {continue;}
+        if(strcmp(t->children[i]->contents, "}")==0) {continue;}
+        if(strcmp(t->children[i]->contents, "[")==0) {continue;}
+        if(strcmp(t->children[i]->contents, "]")==0) {continue;}
+        if(strcmp(t->children[i]->tag,  "regex")==0) {continue;}
+        if(strstr(t->children[i]->tag, "comment")) {continue;}
+        x=lval_add(x, lval_read(t->children[i]));
+    }
+    return x;
+}
+
+lval* lval_join(lval* x, lval* y)
+{
+    for(int i=0; i<y->count; i++)
+    {
+        x=lval_add(x,y->cell[i]);
+    }
+    lheap_free(y->cell);
+    if(nisp_ctx)
+    {
+        nisp_ctx->stats.frees++;
+        nisp_ctx->stats.bytes-=sizeof(lval);
+    }
+    free(y);
+    return x;
+}
+
+//Whether a call to f can run its native code
+int lval_jit_ok(lval* f)
+{
+    return f->jit && nisp_ctx->caching && nisp_ctx->max_steps==LONG_MAX && !nisp_ctx->deadline;
+}
+
+//A recur can't reach a loop outside the function it is in, so one still
+//unwinding at the end of the body is a plain error
+lval* lval_unrecur(lval* x)
+{
+    if(x->type==LVAL_ERR && x->code==LERR_RECUR)
+    {
+        if(nisp_ctx->recur)
+        {
+            lval_del(nisp_ctx->recur);
+            nisp_ctx->recur=NULL;
+        }
+        x->code=LERR_ERROR;
+    }
+    return x;
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a)
+{
+   if (f->builtin)
+    {
+        if (f->desc && f->desc->fast && lbdesc_fits(f->desc, a))
+        {
+            return f->desc->fast(e, a);
+        }
+        return f->rtype ? lrec_apply(f, a) : f->builtin(e, a);
+    }
+    if (f->macro)
+    {
+        //Called as a value, e.g. through map, the arguments are already
+        //evaluated and evaluate to themselves inside the expansion
+        lval* v=lval_join(lval_add(lval_sexpr(), lval_copy(f)), a);
+        lval* x=lmacro_expand(f, v);
+        lval_del(v);
+        return lval_eval(e, x);
+    }
+    if (lval_jit_ok(f))
+    {
+        lval* x=ljit_call(f->jit, a);
+        if (x)
+        {
+            return x;
+        }
+    }
+    int given=a->count;
+    int total=f->formals->count;
+    while (a->count)
+    {
+        if (f->formals->count==0)
+        {
+            lval_del(a);
+            return lval_errc(LERR_ARGS, "Function passed too many arguments.\nGot %i\nExpected %i\n", given, total);
+        }
+        lval* sym = lval_pop(f->formals, 0);
+        if (strcmp(sym->sym, "&")==0)
+        {
+            if (f->formals->count!=1)
+            {
+                lval_del(a);
+                return lval_err("Function format invalid. " "Symbol '&' not followed by single symbol.");
+            }
+            lval* nsym=lval_pop(f->formals, 0);
+            lenv_put(f->env, nsym, builtin_list(e, a));
+            lval_del(sym);
+            lval_del(nsym);
+            break;
+      }
+      lval* val=lval_pop(a, 0);
+      lenv_put(f->env, sym, val);
+      lval_del(sym);
+      lval_del(val);
+    }
+    lval_del(a);
+    if (f->formals->count>0 && strcmp(f->formals->cell[0]->sym, "&")==0)
+    {
+        if (f->formals->count!=2)
+        {
+            return lval_err("Function format invalid. " "Symbol '&' not followed by single symbol.");
+        }
+        lval_del(lval_pop(f->formals, 0));
+        lval* sym=lval_pop(f->formals, 0);
+        lval* val=lval_qexpr();
+        lenv_put(f->env, sym, val);
+        lval_del(sym);
+        lval_del(val);
+    }
+    if (f->formals->count==0)
+    {
+        f->env->par=e;
+        return lval_unrecur(lval_eval_code(f->env, lval_body(f)));
+    }
+    else
+    {
+        return lval_copy(f);
+    }
+
+}
+
+//Call f on a, leaving f untouched where lval_call consumes its formals. A
+//call with all its arguments binds them in a new frame and evaluates the
+//body in place; anything else goes through a private copy of f.
+lval* lval_apply(lenv* e, lval* f, lval* a)
+{
+    if(f->builtin || f->macro)
+    {
+        return lval_call(e, f, a);
+    }
+    if(lval_jit_ok(f))
+    {
+        lval* x=ljit_call(f->jit, a);
+        if(x)
+        {
+            return x;
+        }
+    }
+    int simple=(f->env->count==0 && a->count==f->formals->count);
+    for(int i=0; simple && i<f->formals->count; i++)
+    {
+        simple=(strcmp(f->formals->cell[i]->sym, "&")!=0);
+    }
+    if(!simple)
+    {
+        lval* fn=lval_copy(f);
+        lval* x=lval_call(e, fn, a);
+        lval_del(fn);
+        return x;
+    }
+    lenv* l=lenv_new();
+    l->par=e;
+    l->syms=lheap_alloc(sizeof(char*)*a->count);
+    l->vals=lheap_alloc(sizeof(lval*)*a->count);
+    for(int i=0; i<a->count; i++)
+    {
+        lval* k=f->formals->cell[i];
+        if(nisp_ctx && nisp_ctx->caching)
+        {
+            (k->cache ? k->cache : lsym_intern(nisp_ctx->syms, k->sym))->local=TRUE;
+        }
+        //The arguments are moved into the frame rather than copied, and a
+        //repeated formal takes the later one as lenv_put would
+        int j=0;
+        while(j<l->count && strcmp(l->syms[j], k->sym)!=0)
+        {
+            j++;
+        }
+        if(j<l->count)
+        {
+            lval_del(l->vals[j]);
+        }
+        else
+        {
+            l->syms[j]=lheap_alloc(strlen(k->sym)+1);
+            strcpy(l->syms[j], k->sym);
+            l->count++;
+        }
+        l->vals[j]=a->cell[i];
+    }
+    a->count=0;
+    lval_del(a);
+    lval* x=lval_unrecur(lval_eval_code(l, lval_body(f)));
+    lenv_del(l);
+    return x;
+}
+
+//Evaluate v without consuming it, allocating only the values computed
+lval* lval_eval_ref(lenv* e, lval* v)
+{
+    if(lbudget_spend(nisp_ctx))
+    {
+        return lbudget_err(nisp_ctx);
+    }
+    if(v->type==LVAL_SYM)
+    {
+        return lenv_get(e, v);
+    }
+    if(v->type==LVAL_SEXPR)
+    {
+        return lval_eval_code(e, v);
+    }
+    return lval_copy(v);
+}
+
+//Evaluate the cells of v as an S-Expression, whatever its type, without
+//consuming it. Function bodies, if branches and loop bodies are run this
+//way, so none of them are copied to be evaluated. A function named by a
+//symbol is pinned in its binding rather than copied, so that rebinding it
+//during the call leaves it to be freed after, see lenv_retire.
+lval* lval_eval_code(lenv* e, lval* v)
+{
+    if(v->count==0)
+    {
+        return lval_sexpr();
+    }
+    if(v->count==1)
+    {
+        lval* x=lval_eval_ref(e, v->cell[0]);
+        return x->type==LVAL_ERR ? x : lval_eval(e, x);
+    }
+    lval* f;
+    int pinned=FALSE;
+    if(v->cell[0]->type==LVAL_SYM)
+    {
+        f=lenv_find(e, v->cell[0]);
+        if(!f)
+        {
+            return lval_errc(LERR_UNBOUND, "Unbound Symbol '%s'", v->cell[0]->sym);
+        }
+        pinned=(f->type==LVAL_FUN);
+        if(pinned)
+        {
+            __atomic_add_fetch(&f->pins, 1, __ATOMIC_ACQ_REL);
+        }
+        else
+        {
+            f=lval_copy(f);
+        }
+    }
+    else
+    {
+        f=lval_eval_ref(e, v->cell[0]);
+    }
+    lval* x=NULL;
+    if(f->type==LVAL_ERR)
+    {
+        x=f;
+        f=NULL;
+    }
+    else if(f->type==LVAL_FUN && f->macro)
+    {
+        //Macro arguments are passed unevaluated, and the expansion run
+        x=lval_eval(e, lmacro_expand(f, v));
+    }
+    else if(f->type==LVAL_FUN && f->builtin==builtin_if && !f->rtype && v->count==4
+        && v->cell[2]->type==LVAL_QEXPR && v->cell[3]->type==LVAL_QEXPR)
+    {
+        lval* t=lval_eval_ref(e, v->cell[1]);
+        if(t->type==LVAL_NUM)
+        {
+            x=lval_eval_code(e, v->cell[t->num ? 2 : 3]);
+            lval_del(t);
+        }
+        else
+        {
+            //Let if itself report the error
+            x=t->type==LVAL_ERR ? t : builtin_if(e, lval_add(lval_add(lval_add(lval_sexpr(), t), lval_copy(v->cell[2])), lval_copy(v->cell[3])));
+        }
+    }
+    else if(f->type==LVAL_FUN && f->builtin==builtin_eval && !f->rtype && v->count==2 && v->cell[1]->type==LVAL_QEXPR)
+    {
+        x=lval_eval_code(e, v->cell[1]);
+    }
+    else
+    {
+        //Stop at the first error, the rest is never evaluated
+        lval* a=lval_sexpr();
+        for(int i=1; i<v->count; i++)
+        {
+            lval* y=lval_eval_ref(e, v->cell[i]);
+            if(y->type==LVAL_ERR)
+            {
+                x=y;
+                break;
+            }
+            a=lval_add(a, y);
+        }
+        if(x)
+        {
+            lval_del(a);
+        }
+        else if(f->type!=LVAL_FUN)
+        {
+            lval_del(a);
+            x=lval_errc(LERR_TYPE, "S-Expression begins with invalid type.\n" "Received: %s\nExpected: %s", ltype_name(f->type), ltype_name(LVAL_FUN));
+        }
+        else
+        {
+            x=lval_apply(e, f, a);
+        }
+    }
+    if(pinned)
+    {
+        lval_unpin(f);
+    }
+    else if(f)
+    {
+        lval_del(f);
+    }
+    return x;
+}
+
+/************************************************************
+*********************PARALLEL_FUNCTIONS**********************
+************************************************************/
+
+//Worker count for pmap, pfilter and preduce (NISP_THREADS or -t)
+int nisp_threads=1;
+
+enum { LPAR_MAP, LPAR_FILTER, LPAR_REDUCE };
+
+//Range of task indexes owned by one worker. The owner takes from the
+//bottom, idle workers steal the top half.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int lo;
+    int hi;
+} lqueue;
+
+typedef struct
+{
+    int mode;
+    lenv* env;
+    lval* f;
+    lval** items;
+    int count;
+    int block; //items per task for preduce
+    lval** results;
+    int workers;
+    lqueue* queues;
+    lctx* ctx;
+    lshare* share;
+} ljob;
+
+typedef struct
+{
+    ljob* job;
+    int id;
+    lstats stats;
+    long steps; //used
+    int over;
+} lworker;
+
+//Call f, shared with the other workers, which lval_apply leaves untouched
+lval* lpar_call(lenv* e, lval* f, lval* a)
+{
+    return lval_apply(e, f, a);
+}
+
+void lpar_run(ljob* job, lenv* e, int i)
+{
+    if(job->mode==LPAR_REDUCE)
+    {
+        int lo=i*job->block;
+        int hi=lo+job->block < job->count ? lo+job->block : job->count;
+        lval* acc=lval_copy(job->items[lo]);
+        for(int j=lo+1; j<hi && acc->type!=LVAL_ERR; j++)
+        {
+            lval* a=lval_add(lval_add(lval_sexpr(), acc), lval_copy(job->items[j]));
+            acc=lpar_call(e, job->f, a);
+        }
+        job->results[i]=acc;
+        return;
+    }
+    lval* a=lval_add(lval_sexpr(), lval_copy(job->items[i]));
+    job->results[i]=lpar_call(e, job->f, a);
+}
+
+//Take one task from our own queue, or steal half of another's
+int lpar_next(ljob* job, int id)
+{
+    lqueue* q=&job->queues[id];
+    int i=-1;
+    pthread_mutex_lock(&q->lock);
+    if(q->lo < q->hi)
+    {
+        i=q->lo++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if(i>=0)
+    {
+        return i;
+    }
+    for(int k=1; k<job->workers; k++)
+    {
+        lqueue* v=&job->queues[(id+k)%job->workers];
+        int lo=0;
+        int hi=0;
+        pthread_mutex_lock(&v->lock);
+        if(v->lo < v->hi)
+        {
+            hi=v->hi;
+            lo=v->hi-(v->hi-v->lo+1)/2;
+            v->hi=lo;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if(lo<hi)
+        {
+            pthread_mutex_lock(&q->lock);
+            q->lo=lo+1;
+            q->hi=hi;
+            pthread_mutex_unlock(&q->lock);
+            return lo;
+        }
+    }
+    return -1;
+}
+
+void* lpar_worker(void* arg)
+{
+    lworker* w=arg;
+    //Each worker gets its own context for stats, drawing on the caller's
+    //budget, and evaluates in its own root env so def and = never write
+    //into the env shared with the others
+    lctx* old=nisp_ctx;
+    lctx c=*w->job->ctx;
+    lshare* s=w->job->share;
+    memset(&c.stats, 0, sizeof(lstats));
+    c.steps=0;
+    c.fuel=0;
+    c.share=s;
+    c.shared=0;
+    c.max_bytes=s->max_bytes==LONG_MAX ? LONG_MAX : s->max_bytes-s->bytes;
+    c.caching=FALSE;
+    c.recur=NULL;
+    c.server=NULL;
+    //Coroutines belong to the thread that spawned them
+    c.main=NULL;
+    c.co=NULL;
+    c.ready=NULL;
+    c.ready_tail=NULL;
+    c.blocked=NULL;
+    c.dead=NULL;
+    nisp_ctx=&c;
+    lenv* e=lenv_new();
+    e->par=w->job->env;
+    e->root=TRUE;
+    int i;
+    while((i=lpar_next(w->job, w->id))>=0)
+    {
+        lpar_run(w->job, e, i);
+    }
+    lco_run(&c);
+    lco_del_all(&c);
+    lenv_del(e);
+    if(c.recur)
+    {
+        lval_del(c.recur);
+    }
+    lctx_settle(&c);
+    __atomic_add_fetch(&s->bytes, c.stats.bytes-c.shared, __ATOMIC_ACQ_REL);
+    w->stats=c.stats;
+    w->steps=c.steps;
+    w->over=c.over;
+    nisp_ctx=old;
+    return NULL;
+}
+
+//Run tasks 0..tasks-1 across the pool, the calling thread is worker 0
+void lpar_exec(ljob* job, int tasks)
+{
+    job->workers=nisp_threads < tasks ? nisp_threads : tasks;
+    if(job->workers<1)
+    {
+        job->workers=1;
+    }
+    //Workers draw on what is left of the caller's budget, or on the pool
+    //the caller itself draws on when it is a worker
+    lctx* c=job->ctx;
+    lctx_settle(c);
+    lshare own={c->max_steps-c->steps, c->stats.bytes, c->max_bytes};
+    job->share=c->share ? c->share : &own;
+    job->queues=malloc(sizeof(lqueue) * job->workers);
+    lworker* ws=malloc(sizeof(lworker) * job->workers);
+    pthread_t* threads=malloc(sizeof(pthread_t) * job->workers);
+    for(int i=0; i<job->workers; i++)
+    {
+        pthread_mutex_init(&job->queues[i].lock, NULL);
+        job->queues[i].lo=(int) ((long) tasks*i/job->workers);
+        job->queues[i].hi=(int) ((long) tasks*(i+1)/job->workers);
+        ws[i].job=job;
+        ws[i].id=i;
+    }
+    for(int i=1; i<job->workers; i++)
+    {
+        pthread_create(&threads[i], NULL, lpar_worker, &ws[i]);
+    }
+    lpar_worker(&ws[0]);
+    for(int i=1; i<job->workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for(int i=0; i<job->workers; i++)
+    {
+        pthread_mutex_destroy(&job->queues[i].lock);
+        //The values a worker still holds are its results, now the caller's
+        c->stats.allocs+=ws[i].stats.allocs;
+        c->stats.frees+=ws[i].stats.frees;
+        c->stats.bytes+=ws[i].stats.bytes;
+        c->shared+=c->share ? ws[i].stats.bytes : 0;
+        c->steps+=ws[i].steps;
+        if(c->over==LOVER_NONE)
+        {
+            c->over=ws[i].over;
+        }
+    }
+    free(threads);
+    free(ws);
+    free(job->queues);
+}
+
+lval* builtin_par(lenv* e, lval* a, char* func, int mode)
+{
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    if(mode==LPAR_REDUCE)
+    {
+        LASSERT_NOT_EMPTY(func, a, 1);
+    }
+    lval* list=a->cell[1];
+    ljob job;
+    job.mode=mode;
+    job.ctx=nisp_ctx;
+    job.env=e;
+    job.f=a->cell[0];
+    job.items=list->cell;
+    job.count=list->count;
+    int tasks=job.count;
+    if(mode==LPAR_REDUCE)
+    {
+        //A few blocks per thread keeps stealing useful on uneven work
+        job.block=(job.count+nisp_threads*4-1)/(nisp_threads*4);
+        tasks=(job.count+job.block-1)/job.block;
+    }
+    job.results=malloc(sizeof(lval*) * (tasks ? tasks : 1));
+    lpar_exec(&job, tasks);
+
+    //Collect results in list order, the first error wins
+    lval* x=lval_qexpr();
+    lval* err=NULL;
+    for(int i=0; i<tasks; i++)
+    {
+        lval* r=job.results[i];
+        if(err || r->type==LVAL_ERR)
+        {
+            if(!err)
+            {
+                err=r;
+            }
+            else
+            {
+                lval_del(r);
+            }
+            continue;
+        }
+        if(mode==LPAR_FILTER)
+        {
+            if(r->type!=LVAL_NUM)
+            {
+                err=lval_errc(LERR_TYPE, "Function '%s' expected a Number from its predicate.\nRecieved: %s", func, ltype_name(r->type));
+            }
+            else if(r->num)
+            {
+                x=lval_add(x, lval_copy(list->cell[i]));
+            }
+            lval_del(r);
+            continue;
+        }
+        if(mode==LPAR_REDUCE && x->count)
+        {
+            lval* acc=lval_pop(x, 0);
+            r=lpar_call(e, job.f, lval_add(lval_add(lval_sexpr(), acc), r));
+            if(r->type==LVAL_ERR)
+            {
+                err=r;
+                continue;
+            }
+        }
+        x=lval_add(x, r);
+    }
+    free(job.results);
+    lval_del(a);
+    if(err)
+    {
+        lval_del(x);
+        return err;
+    }
+    return mode==LPAR_REDUCE ? lval_take(x, 0) : x;
+}
+
+lval* builtin_pmap(lenv* e, lval* a)
+{
+    return builtin_par(e, a, "pmap", LPAR_MAP);
+}
+
+lval* builtin_pfilter(lenv* e, lval* a)
+{
+    return builtin_par(e, a, "pfilter", LPAR_FILTER);
+}
+
+lval* builtin_preduce(lenv* e, lval* a)
+{
+    return builtin_par(e, a, "preduce", LPAR_REDUCE);
+}
+
+/************************************************************
+*********************SEQUENCE_FUNCTIONS**********************
+************************************************************/
+
+//Lazy sequences. A sequence is an immutable, shared description of a
+//pipeline; elements are only produced while a cursor walks it, one at a
+//time, so map, filter and take fuse without building intermediate lists.
+enum { LSEQ_LIST, LSEQ_RANGE, LSEQ_ITERATE, LSEQ_REPEAT, LSEQ_LINES, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE };
+
+typedef struct lcursor lcursor;
+struct lcursor
+{
+    lseq* seq;
+    double num;
+    long pos;
+    lval* val;
+    FILE* file;
+    lcursor* src;
+};
+
+lseq* lseq_new(int kind, lseq* src)
+{
+    lseq* s=lheap_alloc(sizeof(lseq));
+    memset(s, 0, sizeof(lseq));
+    s->kind=kind;
+    s->refs=1;
+    s->src=src;
+    return s;
+}
+
+//Sequences are shared between copies, and pmap workers, so count atomically
+void lseq_del(lseq* s)
+{
+    if(__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL)>0)
+    {
+        return;
+    }
+    if(s->f)
+    {
+        lval_del(s->f);
+    }
+    if(s->x)
+    {
+        lval_del(s->x);
+    }
+    if(s->src)
+    {
+        lseq_del(s->src);
+    }
+    free(s->path);
+    lheap_free(s);
+}
+
+lval* lval_seq(lseq* s)
+{
+    lval* v=lval_new(LVAL_SEQ);
+    v->seq=s;
+    return v;
+}
+
+//Sequence to read from, Q-Expressions are read element by element
+lseq* lseq_source(lval* v)
+{
+    if(v->type==LVAL_SEQ)
+    {
+        __atomic_add_fetch(&v->seq->refs, 1, __ATOMIC_ACQ_REL);
+        return v->seq;
+    }
+    lseq* s=lseq_new(LSEQ_LIST, NULL);
+    s->x=lval_copy(v);
+    return s;
+}
+
+lcursor* lcursor_new(lseq* s)
+{
+    lcursor* c=calloc(1, sizeof(lcursor));
+    c->seq=s;
+    c->num=s->start;
+    c->pos=0;
+    if(s->src)
+    {
+        c->src=lcursor_new(s->src);
+    }
+    return c;
+}
+
+void lcursor_del(lcursor* c)
+{
+    if(c->val)
+    {
+        lval_del(c->val);
+    }
+    if(c->file)
+    {
+        fclose(c->file);
+    }
+    if(c->src)
+    {
+        lcursor_del(c->src);
+    }
+    free(c);
+}
+
+//Call f on x
+lval* lseq_apply(lenv* e, lval* f, lval* x)
+{
+    return lval_apply(e, f, lval_add(lval_sexpr(), x));
+}
+
+//Produce the next element, NULL at the end, or an error
+lval* lcursor_next(lenv* e, lcursor* c)
+{
+    lseq* s=c->seq;
+    lval* v;
+    //Producing an element is a step, so realize and fold are bounded too
+    if(lbudget_spend(nisp_ctx))
+    {
+        return lbudget_err(nisp_ctx);
+    }
+    switch(s->kind)
+    {
+        case LSEQ_LIST:
+            return c->pos < s->x->count ? lval_copy(s->x->cell[c->pos++]) : NULL;
+        case LSEQ_RANGE:
+            if(s->step>0 ? c->num>=s->stop : c->num<=s->stop)
+            {
+                return NULL;
+            }
+            v=lval_num(c->num);
+            c->num+=s->step;
+            return v;
+        case LSEQ_ITERATE:
+            if(!c->val)
+            {
+                c->val=lval_copy(s->x);
+            }
+            else if(c->val->type!=LVAL_ERR)
+            {
+                c->val=lseq_apply(e, s->f, c->val);
+            }
+            return lval_copy(c->val);
+        case LSEQ_REPEAT:
+            return lval_copy(s->x);
+        case LSEQ_LINES:
+        {
+            if(!c->file && !(c->file=fopen(s->path, "r")))
+            {
+                return lval_errc(LERR_LOAD, "Could not open file %s", s->path);
+            }
+            char* line=NULL;
+            size_t cap=0;
+            ssize_t len=getline(&line, &cap, c->file);
+            if(len<0)
+            {
+                free(line);
+                return NULL;
+            }
+            if(len>0 && line[len-1]=='\n')
+            {
+                line[len-1]='\0';
+            }
+            v=lval_str(line);
+            free(line);
+            return v;
+        }
+        case LSEQ_MAP:
+            v=lcursor_next(e, c->src);
+            return (!v || v->type==LVAL_ERR) ? v : lseq_apply(e, s->f, v);
+        case LSEQ_FILTER:
+            while((v=lcursor_next(e, c->src)) && v->type!=LVAL_ERR)
+            {
+                lval* r=lseq_apply(e, s->f, lval_copy(v));
+                if(r->type!=LVAL_NUM)
+                {
+                    lval_del(v);
+                    if(r->type==LVAL_ERR)
+                    {
+                        return r;
+                    }
+                    lval* err=lval_errc(LERR_TYPE, "Function '%s' expected a Number from its predicate.\nRecieved: %s", "filter", ltype_name(r->type));
+                    lval_del(r);
+                    return err;
+                }
+                int keep=(r->num!=0);
+                lval_del(r);
+                if(keep)
+                {
+                    return v;
+                }
+                lval_del(v);
+            }
+            return v;
+        case LSEQ_TAKE:
+            if(c->pos>=s->n)
+            {
+                return NULL;
+            }
+            c->pos++;
+            return lcursor_next(e, c->src);
+    }
+    return NULL;
+}
+
+lval* builtin_range(lenv* e, lval* a)
+{
+    LASSERT_CODE(a, a->count>=1 && a->count<=3, LERR_ARGS, "Function '%s' received bad number of args.\nRecieved: %i\nExpected: 1 to 3", "range", a->count);
+    for(int i=0; i<a->count; i++)
+    {
+        LASSERT_TYPE("range", a, i, LVAL_NUM);
+    }
+    LASSERT(a, a->count<3 || a->cell[2]->num!=0, "Function 'range' passed a step of 0.");
+    lseq* s=lseq_new(LSEQ_RANGE, NULL);
+    s->start=a->count>1 ? a->cell[0]->num : 0;
+    s->stop=a->count>1 ? a->cell[1]->num : a->cell[0]->num;
+    s->step=a->count>2 ? a->cell[2]->num : 1;
+    lval_del(a);
+    return lval_seq(s);
+}
+
+lval* builtin_iterate(lenv* e, lval* a)
+{
+    LASSERT_NUM("iterate", a, 2);
+    LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+    lseq* s=lseq_new(LSEQ_ITERATE, NULL);
+    s->f=lval_pop(a, 0);
+    s->x=lval_take(a, 0);
+    return lval_seq(s);
+}
+
+lval* builtin_repeat(lenv* e, lval* a)
+{
+    LASSERT_NUM("repeat", a, 1);
+    lseq* s=lseq_new(LSEQ_REPEAT, NULL);
+    s->x=lval_take(a, 0);
+    return lval_seq(s);
+}
+
+lval* builtin_lines_of_file(lenv* e, lval* a)
+{
+    LASSERT_NUM("lines-of-file", a, 1);
+    LASSERT_TYPE("lines-of-file", a, 0, LVAL_STR);
+    lseq* s=lseq_new(LSEQ_LINES, NULL);
+    s->path=malloc(strlen(a->cell[0]->str)+1);
+    strcpy(s->path, a->cell[0]->str);
+    lval_del(a);
+    return lval_seq(s);
+}
+
+//map, filter: f followed by a sequence or Q-Expression
+lval* builtin_seq_fn(lenv* e, lval* a, char* func, int kind)
+{
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_CODE(a, a->cell[1]->type==LVAL_SEQ || a->cell[1]->type==LVAL_QEXPR, LERR_TYPE, "Function '%s' received incompatable types for argument %i.\nRecieved: %s\nExpected: %s", func, 1, ltype_name(a->cell[1]->type), ltype_name(LVAL_SEQ));
+    lseq* s=lseq_new(kind, lseq_source(a->cell[1]));
+    s->f=lval_pop(a, 0);
+    lval_del(a);
+    return lval_seq(s);
+}
+
+lval* builtin_map(lenv* e, lval* a)
+{
+    return builtin_seq_fn(e, a, "map", LSEQ_MAP);
+}
+
+lval* builtin_filter(lenv* e, lval* a)
+{
+    return builtin_seq_fn(e, a, "filter", LSEQ_FILTER);
+}
+
+lval* builtin_take(lenv* e, lval* a)
+{
+    LASSERT_NUM("take", a, 2);
+    LASSERT_TYPE("take", a, 0, LVAL_NUM);
+    LASSERT_CODE(a, a->cell[1]->type==LVAL_SEQ || a->cell[1]->type==LVAL_QEXPR, LERR_TYPE, "Function '%s' received incompatable types for argument %i.\nRecieved: %s\nExpected: %s", "take", 1, ltype_name(a->cell[1]->type), ltype_name(LVAL_SEQ));
+    lseq* s=lseq_new(LSEQ_TAKE, lseq_source(a->cell[1]));
+    s->n=(long) a->cell[0]->num;
+    lval_del(a);
+    return lval_seq(s);
+}
+
+//Walk a sequence into a Q-Expression
+lval* builtin_realize(lenv* e, lval* a)
+{
+    LASSERT_NUM("realize", a, 1);
+    LASSERT_TYPE("realize", a, 0, LVAL_SEQ);
+    lcursor* c=lcursor_new(a->cell[0]->seq);
+    lval* x=lval_qexpr();
+    lval* v;
+    while((v=lcursor_next(e, c)))
+    {
+        if(v->type==LVAL_ERR)
+        {
+            lval_del(x);
+            x=v;
+            break;
+        }
+        x=lval_add(x, v);
+    }
+    lcursor_del(c);
+    lval_del(a);
+    return x;
+}
+
+//fold f init seq, consuming the sequence one element at a time
+lval* builtin_fold(lenv* e, lval* a)
+{
+    LASSERT_NUM("fold", a, 3);
+    LASSERT_TYPE("fold", a, 0, LVAL_FUN);
+    LASSERT_CODE(a, a->cell[2]->type==LVAL_SEQ || a->cell[2]->type==LVAL_QEXPR, LERR_TYPE, "Function '%s' received incompatable types for argument %i.\nRecieved: %s\nExpected: %s", "fold", 2, ltype_name(a->cell[2]->type), ltype_name(LVAL_SEQ));
+    lseq* s=lseq_source(a->cell[2]);
+    lcursor* c=lcursor_new(s);
+    lval* f=a->cell[0];
+    lval* acc=lval_copy(a->cell[1]);
+    lval* v;
+    while(acc->type!=LVAL_ERR && (v=lcursor_next(e, c)))
+    {
+        if(v->type==LVAL_ERR)
+        {
+            lval_del(acc);
+            acc=v;
+            break;
+        }
+        acc=lval_apply(e, f, lval_add(lval_add(lval_sexpr(), acc), v));
+    }
+    lcursor_del(c);
+    lseq_del(s);
+    lval_del(a);
+    return acc;
+}
+
+/************************************************************
+***********************FILE_FUNCTIONS************************
+************************************************************/
+
+//A file mapped read only. Empty files have no mapping.
+typedef struct
+{
+    char* data;
+    size_t len;
+} lmap;
+
+int lmap_open(lmap* m, char* path)
+{
+    int fd=open(path, O_RDONLY);
+    struct stat st;
+    if(fd<0 || fstat(fd, &st)<0)
+    {
+        if(fd>=0)
+        {
+            close(fd);
+        }
+        return FALSE;
+    }
+    m->len=st.st_size;
+    m->data=NULL;
+    if(m->len)
+    {
+        m->data=mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(m->data==MAP_FAILED)
+        {
+            close(fd);
+            return FALSE;
+        }
+        madvise(m->data, m->len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return TRUE;
+}
+
+void lmap_close(lmap* m)
+{
+    if(m->data)
+    {
+        munmap(m->data, m->len);
+    }
+}
+
+//String from n bytes that need not be terminated
+lval* lval_strn(const char* s, size_t n)
+{
+    lval* v=lval_new(LVAL_STR);
+    v->str=lheap_alloc(n+1);
+    memcpy(v->str, s, n);
+    v->str[n]='\0';
+    return v;
+}
+
+//Q-Expression built a cell at a time, growing by doubling rather than the
+//realloc per element lval_add does
+typedef struct
+{
+    lval* v;
+    int cap;
+} lqbuild;
+
+void lqbuild_add(lqbuild* q, lval* x)
+{
+    if(q->v->count==q->cap)
+    {
+        q->cap=q->cap ? q->cap*2 : 8;
+        q->v->cell=lheap_realloc(q->v->cell, sizeof(lval*) * q->cap);
+    }
+    q->v->cell[q->v->count++]=x;
+}
+
+lval* builtin_read_file(lenv* e, lval* a)
+{
+    LASSERT_NUM("read-file", a, 1);
+    LASSERT_TYPE("read-file", a, 0, LVAL_STR);
+    lmap m;
+    LASSERT_CODE(a, lmap_open(&m, a->cell[0]->str), LERR_LOAD, "Could not open file %s", a->cell[0]->str);
+    lval* x=lval_strn(m.data, m.len);
+    lmap_close(&m);
+    lval_del(a);
+    return x;
+}
+
+//write-file path string, replacing the file
+lval* builtin_write_file(lenv* e, lval* a)
+{
+    LASSERT_NUM("write-file", a, 2);
+    LASSERT_TYPE("write-file", a, 0, LVAL_STR);
+    LASSERT_TYPE("write-file", a, 1, LVAL_STR);
+    FILE* f=fopen(a->cell[0]->str, "w");
+    LASSERT_CODE(a, f, LERR_LOAD, "Could not open file %s", a->cell[0]->str);
+    size_t len=strlen(a->cell[1]->str);
+    int ok=fwrite(a->cell[1]->str, 1, len, f)==len;
+    ok=fclose(f)==0 && ok;
+    LASSERT_CODE(a, ok, LERR_ERROR, "Could not write file %s", a->cell[0]->str);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//All lines of a file, without their newlines, like lines-of-file but eager
+lval* builtin_read_lines(lenv* e, lval* a)
+{
+    LASSERT_NUM("read-lines", a, 1);
+    LASSERT_TYPE("read-lines", a, 0, LVAL_STR);
+    lmap m;
+    LASSERT_CODE(a, lmap_open(&m, a->cell[0]->str), LERR_LOAD, "Could not open file %s", a->cell[0]->str);
+    lqbuild q={lval_qexpr(), 0};
+    char* p=m.data;
+    char* end=m.data+m.len;
+    while(p<end)
+    {
+        char* nl=memchr(p, '\n', end-p);
+        char* stop=nl ? nl : end;
+        lval* line=lval_strn(p, stop-p);
+        lqbuild_add(&q, nisp_hashcons ? lhc_intern(line) : line);
+        p=stop+1;
+    }
+    lmap_close(&m);
+    lval_del(a);
+    return q.v;
+}
+
+//A field that is entirely a decimal number, as the reader would parse it
+//plus exponents, becomes a number. Anything else stays a string.
+lval* lcsv_field(const char* s, size_t n)
+{
+    char tmp[64];
+    if(n==0 || n>=sizeof(tmp) || !(isdigit((unsigned char) *s) || *s=='-' || *s=='+' || *s=='.'))
+    {
+        return lval_strn(s, n);
+    }
+    memcpy(tmp, s, n);
+    tmp[n]='\0';
+    char* stop;
+    errno=0;
+    double d=strtod(tmp, &stop);
+    if(*stop || errno==ERANGE || isnan(d) || isinf(d))
+    {
+        return lval_strn(s, n);
+    }
+    return lval_num(d);
+}
+
+//Rows of a comma separated file as Q-Expressions of fields. Fields may be
+//quoted with "", where a doubled "" is a literal quote. Quoted fields are
+//always strings.
+lval* builtin_read_csv(lenv* e, lval* a)
+{
+    LASSERT_NUM("read-csv", a, 1);
+    LASSERT_TYPE("read-csv", a, 0, LVAL_STR);
+    lmap m;
+    LASSERT_CODE(a, lmap_open(&m, a->cell[0]->str), LERR_LOAD, "Could not open file %s", a->cell[0]->str);
+    lqbuild rows={lval_qexpr(), 0};
+    lbuf quoted={NULL, 0, 0};
+    char* p=m.data;
+    char* end=m.data+m.len;
+    while(p<end)
+    {
+        lqbuild row={lval_qexpr(), 0};
+        for(;;)
+        {
+            if(p<end && *p=='"')
+            {
+                quoted.len=0;
+                for(p++; p<end; p++)
+                {
+                    if(*p=='"')
+                    {
+                        if(p+1<end && p[1]=='"')
+                        {
+                            p++;
+                        }
+                        else
+                        {
+                            p++;
+                            break;
+                        }
+                    }
+                    lbuf_putc(&quoted, *p);
+                }
+                lqbuild_add(&row, lval_strn(quoted.data ? quoted.data : "", quoted.len));
+                while(p<end && *p!=',' && *p!='\n')
+                {
+                    p++;
+                }
+            }
+            else
+            {
+                char* s=p;
+                while(p<end && *p!=',' && *p!='\n')
+                {
+                    p++;
+                }
+                char* stop=p;
+                if(stop>s && stop[-1]=='\r')
+                {
+                    stop--;
+                }
+                lqbuild_add(&row, lcsv_field(s, stop-s));
+            }
+            if(p<end && *p==',')
+            {
+                p++;
+                continue;
+            }
+            p++;
+            break;
+        }
+        //Repeated records are shared as they are read, not once stored
+        lqbuild_add(&rows, nisp_hashcons ? lhc_intern(row.v) : row.v);
+    }
+    free(quoted.data);
+    lmap_close(&m);
+    lval_del(a);
+    return rows.v;
+}
+
+/************************************************************
+**********************STRING_FUNCTIONS***********************
+************************************************************/
+
+//Substring search for the string builtins. The vector versions compare a
+//block of the haystack against the needle's first byte and, the needle's
+//length on, against its last byte. Only where both match is the rest
+//compared, which for text is rarely. The scalar version, for other
+//machines and the tail of the haystack, steps between first bytes with
+//memchr.
+typedef const char*(*lstr_finder)(const char*, size_t, const char*, size_t);
+
+const char* lstr_find_scalar(const char* h, size_t hn, const char* n, size_t nn)
+{
+    if(nn>hn)
+    {
+        return NULL;
+    }
+    const char* end=h+hn-nn+1;
+    for(const char* p=h; (p=memchr(p, n[0], end-p)); p++)
+    {
+        if(memcmp(p, n, nn)==0)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+const char* lstr_find_sse2(const char* h, size_t hn, const char* n, size_t nn)
+{
+    __m128i first=_mm_set1_epi8(n[0]);
+    __m128i last=_mm_set1_epi8(n[nn-1]);
+    size_t i=0;
+    for(; i+nn-1+16<=hn; i+=16)
+    {
+        __m128i a=_mm_loadu_si128((const __m128i*) (h+i));
+        __m128i b=_mm_loadu_si128((const __m128i*) (h+i+nn-1));
+        unsigned m=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while(m)
+        {
+            int k=__builtin_ctz(m);
+            if(nn<3 || memcmp(h+i+k+1, n+1, nn-2)==0)
+            {
+                return h+i+k;
+            }
+            m&=m-1;
+        }
+    }
+    return lstr_find_scalar(h+i, hn-i, n, nn);
+}
+
+__attribute__((target("avx2")))
+const char* lstr_find_avx2(const char* h, size_t hn, const char* n, size_t nn)
+{
+    __m256i first=_mm256_set1_epi8(n[0]);
+    __m256i last=_mm256_set1_epi8(n[nn-1]);
+    size_t i=0;
+    for(; i+nn-1+32<=hn; i+=32)
+    {
+        __m256i a=_mm256_loadu_si256((const __m256i*) (h+i));
+        __m256i b=_mm256_loadu_si256((const __m256i*) (h+i+nn-1));
+        unsigned m=_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while(m)
+        {
+            int k=__builtin_ctz(m);
+            if(nn<3 || memcmp(h+i+k+1, n+1, nn-2)==0)
+            {
+                return h+i+k;
+            }
+            m&=m-1;
+        }
+    }
+    return lstr_find_sse2(h+i, hn-i, n, nn);
+}
+
+#endif
+
+//First occurrence of the nn bytes at n in the hn bytes at h, or NULL. An
+//empty needle is found at the start.
+const char* lstr_find(const char* h, size_t hn, const char* n, size_t nn)
+{
+    static lstr_finder find;
+    if(nn==0)
+    {
+        return h;
+    }
+    if(nn==1)
+    {
+        //memchr is already vectorised, and has nothing to filter
+        return memchr(h, n[0], hn);
+    }
+    if(!find)
+    {
+#if defined(__x86_64__) && defined(__GNUC__)
+        __builtin_cpu_init();
+        find=__builtin_cpu_supports("avx2") ? lstr_find_avx2 : lstr_find_sse2;
+#else
+        find=lstr_find_scalar;
+#endif
+    }
+    return find(h, hn, n, nn);
+}
+
+//Whether the n bytes at s match the glob segment p, where ? is any byte
+int lglob_seg_eq(const char* s, const char* p, size_t n)
+{
+    for(size_t i=0; i<n; i++)
+    {
+        if(p[i]!='?' && p[i]!=s[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+//First match of the glob segment p in the sn bytes at s, or NULL
+const char* lglob_seg_find(const char* s, size_t sn, const char* p, size_t pn)
+{
+    if(!memchr(p, '?', pn))
+    {
+        return lstr_find(s, sn, p, pn);
+    }
+    for(size_t i=0; i+pn<=sn; i++)
+    {
+        if(lglob_seg_eq(s+i, p, pn))
+        {
+            return s+i;
+        }
+    }
+    return NULL;
+}
+
+//Whether all of s matches the glob p, where * is any run of bytes and ? is
+//any one byte. The segments between stars are matched from the ends in,
+//each middle one at its first match, which never rules out a match.
+int lglob(const char* s, const char* p)
+{
+    size_t sn=strlen(s);
+    const char* star=strchr(p, '*');
+    if(!star)
+    {
+        return strlen(p)==sn && lglob_seg_eq(s, p, sn);
+    }
+    size_t head=star-p;
+    if(head>sn || !lglob_seg_eq(s, p, head))
+    {
+        return FALSE;
+    }
+    s+=head;
+    sn-=head;
+    const char* tail=strrchr(p, '*')+1;
+    size_t tn=strlen(tail);
+    if(tn>sn || !lglob_seg_eq(s+sn-tn, tail, tn))
+    {
+        return FALSE;
+    }
+    sn-=tn;
+    for(p=star+1; p<tail; )
+    {
+        const char* next=strchr(p, '*');
+        size_t n=next-p;
+        const char* at=lglob_seg_find(s, sn, p, n);
+        if(!at)
+        {
+            return FALSE;
+        }
+        sn-=at+n-s;
+        s=at+n;
+        p=next+1;
+    }
+    return TRUE;
+}
+
+//(str-find s x) is the index of the first x in s, or -1
+lval* builtin_str_find(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-find", a, 2);
+    LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+    char* s=a->cell[0]->str;
+    char* x=a->cell[1]->str;
+    const char* at=lstr_find(s, strlen(s), x, strlen(x));
+    lval* r=lval_num(at ? at-s : -1);
+    lval_del(a);
+    return r;
+}
+
+//(str-count s x) counts the occurrences of x in s that don't overlap
+lval* builtin_str_count(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-count", a, 2);
+    LASSERT_TYPE("str-count", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-count", a, 1, LVAL_STR);
+    LASSERT_CODE(a, a->cell[1]->str[0], LERR_ARGS, "Function 'str-count' passed empty string for argument 1.");
+    char* s=a->cell[0]->str;
+    char* x=a->cell[1]->str;
+    size_t sn=strlen(s);
+    size_t xn=strlen(x);
+    double n=0;
+    for(const char* p=s; (p=lstr_find(p, sn-(p-s), x, xn)); p+=xn)
+    {
+        n++;
+    }
+    lval_del(a);
+    return lval_num(n);
+}
+
+//(str-split s d) is the pieces of s between each d, empty ones included
+lval* builtin_str_split(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-split", a, 2);
+    LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+    LASSERT_CODE(a, a->cell[1]->str[0], LERR_ARGS, "Function 'str-split' passed empty string for argument 1.");
+    char* s=a->cell[0]->str;
+    char* d=a->cell[1]->str;
+    size_t sn=strlen(s);
+    size_t dn=strlen(d);
+    lqbuild q={lval_qexpr(), 0};
+    const char* p=s;
+    for(;;)
+    {
+        const char* at=lstr_find(p, sn-(p-s), d, dn);
+        const char* stop=at ? at : s+sn;
+        lqbuild_add(&q, lval_strn(p, stop-p));
+        if(!at)
+        {
+            break;
+        }
+        p=at+dn;
+    }
+    lval_del(a);
+    return q.v;
+}
+
+//(str-starts-with s x) is 1 if s begins with x
+lval* builtin_str_starts_with(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-starts-with", a, 2);
+    LASSERT_TYPE("str-starts-with", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-starts-with", a, 1, LVAL_STR);
+    char* x=a->cell[1]->str;
+    lval* r=lval_num(strncmp(a->cell[0]->str, x, strlen(x))==0);
+    lval_del(a);
+    return r;
+}
+
+//(str-match s glob) is 1 if all of s matches glob, see lglob
+lval* builtin_str_match(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-match", a, 2);
+    LASSERT_TYPE("str-match", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-match", a, 1, LVAL_STR);
+    lval* r=lval_num(lglob(a->cell[0]->str, a->cell[1]->str));
+    lval_del(a);
+    return r;
+}
+
+/************************************************************
+**************************MODULES****************************
+************************************************************/
+
+//Parsed files are cached on disk, so an unchanged file is read back as
+//values rather than parsed again. The cache for a file is keyed by its
+//real path, and is used only while the file's mtime, size and content hash
+//still match the ones it was written for.
+#define LMOD_MAGIC "nisp-parse-1\n"
+
+uint64_t lmod_hash(const char* s, size_t n)
+{
+    uint64_t h=14695981039346656037u;
+    for(size_t i=0; i<n; i++)
+    {
+        h=(h^(unsigned char) s[i])*1099511628211u;
+    }
+    return h;
+}
+
+//Key a cache entry is checked against
+typedef struct
+{
+    int64_t sec;
+    int64_t nsec;
+    int64_t size;
+    uint64_t hash;
+} lmod_key;
+
+//Cache file for the file at real path, or NULL when caching is off.
+//NISP_CACHE names the directory, an empty one turns caching off, and it
+//defaults to ~/.cache/nisp.
+char* lmod_cache_path(char* real)
+{
+    char* dir=getenv("NISP_CACHE");
+    lbuf b={NULL, 0, 0};
+    if(dir)
+    {
+        if(!*dir)
+        {
+            return NULL;
+        }
+        lbuf_puts(&b, dir);
+    }
+    else
+    {
+        if(!getenv("HOME"))
+        {
+            return NULL;
+        }
+        lbuf_printf(&b, "%s/.cache", getenv("HOME"));
+        lbuf_putc(&b, '\0');
+        mkdir(b.data, 0755);
+        b.len--;
+        lbuf_puts(&b, "/nisp");
+    }
+    lbuf_putc(&b, '\0');
+    mkdir(b.data, 0755);
+    b.len--;
+    lbuf_printf(&b, "/%016llx.nspc", (unsigned long long) lmod_hash(real, strlen(real)));
+    lbuf_putc(&b, '\0');
+    return b.data;
+}
+
+//Values are written depth first, each as a tag byte followed by the number,
+//the length and bytes of a symbol or string, or the count of a list
+int lmod_put(lbuf* b, lval* v)
+{
+    uint32_t n;
+    switch(v->type)
+    {
+        case LVAL_NUM:
+            lbuf_putc(b, 'n');
+            lbuf_write(b, (char*) &v->num, sizeof(double));
+            return TRUE;
+        case LVAL_SYM:
+        case LVAL_STR:
+            lbuf_putc(b, v->type==LVAL_SYM ? 's' : 't');
+            n=strlen(v->type==LVAL_SYM ? v->sym : v->str);
+            lbuf_write(b, (char*) &n, sizeof(n));
+            lbuf_write(b, v->type==LVAL_SYM ? v->sym : v->str, n);
+            return TRUE;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lbuf_putc(b, v->type==LVAL_SEXPR ? '(' : '{');
+            n=v->count;
+            lbuf_write(b, (char*) &n, sizeof(n));
+            return TRUE;
+    }
+    //Only what the reader produces is cached, not e.g. its number errors
+    return FALSE;
+}
+
+void lmod_cache_write(char* cache, char* real, lmod_key* k, lval* expr)
+{
+    lbuf b={NULL, 0, 0};
+    uint32_t n=strlen(real);
+    lbuf_puts(&b, LMOD_MAGIC);
+    lbuf_write(&b, (char*) k, sizeof(lmod_key));
+    lbuf_write(&b, (char*) &n, sizeof(n));
+    lbuf_write(&b, real, n);
+    int ok=lmod_put(&b, expr);
+    lwork w;
+    lwork_init(&w);
+    lwork_push(&w, expr, NULL);
+    while(ok && w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==p->v->count)
+        {
+            w.count--;
+            continue;
+        }
+        lval* x=p->v->cell[p->i++];
+        ok=lmod_put(&b, x);
+        if(x->type==LVAL_SEXPR || x->type==LVAL_QEXPR)
+        {
+            lwork_push(&w, x, NULL);
+        }
+    }
+    lwork_free(&w);
+
+    //Written aside under a name of its own, since other threads and
+    //processes may be writing the same entry, and renamed over the old
+    //one so readers never see half a file
+    lbuf tmp={NULL, 0, 0};
+    lbuf_printf(&tmp, "%s.XXXXXX", cache);
+    lbuf_putc(&tmp, '\0');
+    int fd=ok ? mkstemp(tmp.data) : -1;
+    if(fd>=0)
+    {
+        //Readable like any other file, mkstemp makes it private
+        fchmod(fd, 0644);
+    }
+    FILE* f=fd>=0 ? fdopen(fd, "wb") : NULL;
+    if(fd>=0 && !f)
+    {
+        close(fd);
+        unlink(tmp.data);
+    }
+    if(f)
+    {
+        ok=(fwrite(b.data, 1, b.len, f)==b.len);
+        ok&=(fclose(f)==0);
+        if(!ok || rename(tmp.data, cache)!=0)
+        {
+            unlink(tmp.data);
+        }
+    }
+    free(tmp.data);
+    free(b.data);
+}
+
+//Bytes of a cache entry being read back
+typedef struct
+{
+    char* p;
+    char* end;
+} lmod_in;
+
+int lmod_take(lmod_in* in, void* x, size_t n)
+{
+    if((size_t) (in->end-in->p)<n)
+    {
+        return FALSE;
+    }
+    memcpy(x, in->p, n);
+    in->p+=n;
+    return TRUE;
+}
+
+//The next value, with room for the count cells of a list, or NULL
+lval* lmod_get(lmod_in* in, uint32_t* count)
+{
+    char tag;
+    uint32_t n;
+    *count=0;
+    if(!lmod_take(in, &tag, 1))
+    {
+        return NULL;
+    }
+    if(tag=='n')
+    {
+        double d;
+        return lmod_take(in, &d, sizeof(double)) ? lval_num(d) : NULL;
+    }
+    if(!lmod_take(in, &n, sizeof(n)))
+    {
+        return NULL;
+    }
+    if(tag=='s' || tag=='t')
+    {
+        if((size_t) (in->end-in->p)<n || memchr(in->p, '\0', n))
+        {
+            return NULL;
+        }
+        lval* v=lval_strn(in->p, n);
+        in->p+=n;
+        if(tag=='s')
+        {
+            lval* s=lval_sym(v->str);
+            lval_del(v);
+            return s;
+        }
+        return v;
+    }
+    if((tag=='(' || tag=='{') && n<=(size_t) (in->end-in->p))
+    {
+        lval* v=tag=='(' ? lval_sexpr() : lval_qexpr();
+        v->cell=n ? lheap_alloc(sizeof(lval*) * n) : NULL;
+        *count=n;
+        return v;
+    }
+    return NULL;
+}
+
+//The forms cached for real, or NULL if there are none for this version
+lval* lmod_cache_read(char* cache, char* real, lmod_key* k)
+{
+    lmap m;
+    if(!lmap_open(&m, cache))
+    {
+        return NULL;
+    }
+    lmod_in in={m.data, m.data+m.len};
+    char magic[sizeof(LMOD_MAGIC)-1];
+    lmod_key key;
+    uint32_t n;
+    if(!lmod_take(&in, magic, sizeof(magic)) || memcmp(magic, LMOD_MAGIC, sizeof(magic))!=0
+        || !lmod_take(&in, &key, sizeof(key)) || memcmp(&key, k, sizeof(key))!=0
+        || !lmod_take(&in, &n, sizeof(n)) || n!=strlen(real) || (size_t) (in.end-in.p)<n || memcmp(in.p, real, n)!=0)
+    {
+        lmap_close(&m);
+        return NULL;
+    }
+    in.p+=n;
+    uint32_t count;
+    lval* root=lmod_get(&in, &count);
+    lwork w;
+    lwork_init(&w);
+    if(root && count)
+    {
+        lwork_push(&w, root, NULL);
+        w.items[w.count-1].i=count;
+    }
+    while(root && w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==p->v->count)
+        {
+            w.count--;
+            continue;
+        }
+        lval* x=lmod_get(&in, &count);
+        if(!x)
+        {
+            lval_del(root);
+            root=NULL;
+            break;
+        }
+        p->v->cell[p->v->count++]=x;
+        if(count)
+        {
+            lwork_push(&w, x, NULL);
+            w.items[w.count-1].i=count;
+        }
+    }
+    lwork_free(&w);
+    lmap_close(&m);
+    if(root && (in.p!=in.end || root->type!=LVAL_SEXPR))
+    {
+        lval_del(root);
+        root=NULL;
+    }
+    return root;
+}
+
+//The forms of a file, as an S-Expression, or an error if it can't be read
+//or parsed. Only require goes through the parse cache, so that load leaves
+//nothing behind on disk.
+lval* lmod_read(char* path, int cached)
+{
+    char* real=realpath(path, NULL);
+    char* cache=(real && cached) ? lmod_cache_path(real) : NULL;
+    lmod_key k;
+    struct stat st;
+    lmap m;
+    if(cache && stat(real, &st)==0 && lmap_open(&m, real))
+    {
+        memset(&k, 0, sizeof(k));
+        k.sec=st.st_mtim.tv_sec;
+        k.nsec=st.st_mtim.tv_nsec;
+        k.size=st.st_size;
+        k.hash=lmod_hash(m.data, m.len);
+        lmap_close(&m);
+        lval* x=lmod_cache_read(cache, real, &k);
+        if(x)
+        {
+            free(cache);
+            free(real);
+            return x;
+        }
+    }
+    else
+    {
+        free(cache);
+        cache=NULL;
+    }
+
+    mpc_result_t r;
+    lval* x;
+    if(mpc_parse_contents(path, nisp_ctx->Lispy, &r))
+    {
+        x=lval_read(r.output);
+        mpc_ast_delete(r.output);
+        if(cache)
+        {
+            lmod_cache_write(cache, real, &k, x);
+        }
+    }
+    else
+    {
+        char* err_msg=mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        x=lval_errc(LERR_LOAD, "Could not load library %s", err_msg);
+        free(err_msg);
+    }
+    free(cache);
+    free(real);
+    return x;
+}
+
+//A module is evaluated once per context into its own root env, which
+//holds its definitions from then on
+struct lmod
+{
+    char* path; //real path
+    lenv* env;
+    int loading;
+    lmod* next;
+};
+
+void lmod_del(lmod* m)
+{
+    lenv_del(m->env);
+    free(m->path);
+    free(m);
+}
+
+//Real path of the module a require names: as given, then with .nsp added,
+//in the current directory for ./ and ../ or absolute paths, otherwise in
+//each directory of NISP_PATH, which defaults to the current one
+char* lmod_find(char* name)
+{
+    int direct=(name[0]=='/' || strncmp(name, "./", 2)==0 || strncmp(name, "../", 3)==0);
+    char* dirs=getenv("NISP_PATH");
+    if(direct || !dirs || !*dirs)
+    {
+        dirs=".";
+    }
+    for(char* d=dirs; d; d=strchr(d, ':') ? strchr(d, ':')+1 : NULL)
+    {
+        size_t n=strchr(d, ':') ? (size_t) (strchr(d, ':')-d) : strlen(d);
+        for(int ext=0; ext<2; ext++)
+        {
+            lbuf b={NULL, 0, 0};
+            if(!direct)
+            {
+                lbuf_write(&b, n ? d : ".", n ? n : 1);
+                lbuf_putc(&b, '/');
+            }
+            lbuf_printf(&b, ext ? "%s.nsp" : "%s", name);
+            lbuf_putc(&b, '\0');
+            struct stat st;
+            char* real=(stat(b.data, &st)==0 && S_ISREG(st.st_mode)) ? realpath(b.data, NULL) : NULL;
+            free(b.data);
+            if(real)
+            {
+                return real;
+            }
+        }
+    }
+    return NULL;
+}
+
+//Point the symbols in a lambda's body that name the module's own
+//definitions at their prefixed names, since under dynamic scope the body
+//runs in its caller's env rather than the module's
+void lmod_rename(lmod* m, lval* f, char* prefix)
+{
+    lwork w;
+    lwork_init(&w);
+    lwork_push(&w, f->body, NULL);
+    while(w.count)
+    {
+        lwalk* p=&w.items[w.count-1];
+        if(p->i==p->v->count)
+        {
+            w.count--;
+            continue;
+        }
+        lval* x=p->v->cell[p->i++];
+        if(x->type==LVAL_SEXPR || x->type==LVAL_QEXPR)
+        {
+            x=p->v->cell[p->i-1]=lval_own(x);
+            lwork_push(&w, x, NULL);
+            continue;
+        }
+        if(x->type!=LVAL_SYM)
+        {
+            continue;
+        }
+        int own=FALSE;
+        for(int i=0; i<m->env->count && !own; i++)
+        {
+            own=(strcmp(m->env->syms[i], x->sym)==0);
+        }
+        for(int i=0; i<f->formals->count && own; i++)
+        {
+            own=(strcmp(f->formals->cell[i]->sym, x->sym)!=0);
+        }
+        if(own)
+        {
+            lbuf b={NULL, 0, 0};
+            lbuf_printf(&b, "%s/%s", prefix, x->sym);
+            lbuf_putc(&b, '\0');
+            p->v->cell[p->i-1]=lval_sym(b.data);
+            lval_del(x);
+            free(b.data);
+        }
+    }
+    lwork_free(&w);
+    //The folded body still has the old names
+    if(f->fold)
+    {
+        lfold_del(f->fold);
+    }
+    f->fold=lfold_new(nisp_ctx->env, f->formals, f->body);
+}
+
+//(require "name") evaluates a module the first time it is required in a
+//context and binds each of its definitions as name/symbol, where name is
+//the file name without directory or .nsp. (require "name" "prefix") binds
+//them as prefix/symbol instead, or unprefixed for "".
+lval* builtin_require(lenv* e, lval* a)
+{
+    LASSERT(a, a->count==1 || a->count==2, "Function 'require' passed %i arguments, expected 1 or 2", a->count);
+    LASSERT_TYPE("require", a, 0, LVAL_STR);
+    if(a->count==2)
+    {
+        LASSERT_TYPE("require", a, 1, LVAL_STR);
+    }
+    char* real=lmod_find(a->cell[0]->str);
+    LASSERT_CODE(a, real, LERR_LOAD, "Could not find module %s", a->cell[0]->str);
+
+    lmod* m=nisp_ctx->mods;
+    while(m && strcmp(m->path, real)!=0)
+    {
+        m=m->next;
+    }
+    if(m)
+    {
+        free(real);
+        LASSERT_CODE(a, !m->loading, LERR_LOAD, "Circular require of %s", a->cell[0]->str);
+    }
+    else
+    {
+        lval* expr=lmod_read(real, TRUE);
+        if(expr->type==LVAL_ERR)
+        {
+            free(real);
+            lval_del(a);
+            return expr;
+        }
+        m=malloc(sizeof(lmod));
+        m->path=real;
+        m->env=lenv_new();
+        m->env->par=nisp_ctx->env;
+        m->env->root=TRUE;
+        m->loading=TRUE;
+        m->next=nisp_ctx->mods;
+        nisp_ctx->mods=m;
+        while(expr->count)
+        {
+            lval* x=lval_eval(m->env, lval_pop(expr, 0));
+            if(x->type==LVAL_ERR)
+            {
+                lval_println(x);
+            }
+            lval_del(x);
+        }
+        lval_del(expr);
+        m->loading=FALSE;
+    }
+
+    char* prefix;
+    if(a->count==2)
+    {
+        prefix=a->cell[1]->str;
+    }
+    else
+    {
+        prefix=strrchr(a->cell[0]->str, '/') ? strrchr(a->cell[0]->str, '/')+1 : a->cell[0]->str;
+        char* dot=strrchr(prefix, '.');
+        if(dot && strcmp(dot, ".nsp")==0)
+        {
+            *dot='\0';
+        }
+    }
+    for(int i=0; i<m->env->count; i++)
+    {
+        lbuf b={NULL, 0, 0};
+        if(*prefix)
+        {
+            lbuf_printf(&b, "%s/", prefix);
+        }
+        lbuf_puts(&b, m->env->syms[i]);
+        lbuf_putc(&b, '\0');
+        lval* k=lval_sym(b.data);
+        lval* v=lval_copy(m->env->vals[i]);
+        if(*prefix && v->type==LVAL_FUN && !v->builtin)
+        {
+            lmod_rename(m, v, prefix);
+        }
+        lenv_def(e, k, v);
+        lval_del(k);
+        lval_del(v);
+        free(b.data);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/************************************************************
+************************COROUTINES***************************
+************************************************************/
+
+//Coroutines are scheduled cooperatively within a context, each on its own
+//C stack, since the evaluator recurses on it. They switch only in yield
+//and when a channel operation has to wait, so nothing else needs to lock.
+//The context's own thread of control is c->main, which has no stack of its
+//own. Stacks are mapped lazily, so only what a coroutine touches is used.
+#define LCO_STACK (8<<20)
+
+void lco_push(lctx* c, lco* co)
+{
+    co->next=NULL;
+    if(c->ready_tail)
+    {
+        c->ready_tail->next=co;
+    }
+    else
+    {
+        c->ready=co;
+    }
+    c->ready_tail=co;
+}
+
+lco* lco_pop(lctx* c)
+{
+    lco* co=c->ready;
+    if(co)
+    {
+        c->ready=co->next;
+        if(!c->ready)
+        {
+            c->ready_tail=NULL;
+        }
+    }
+    return co;
+}
+
+void lco_free(lco* co)
+{
+    if(co->f)
+    {
+        lval_del(co->f);
+        lval_del(co->a);
+    }
+    if(co->stack)
+    {
+        munmap(co->stack, LCO_STACK);
+    }
+    free(co);
+}
+
+//Run to, coming back here once something switches to the current one again
+void lco_switch(lctx* c, lco* to)
+{
+    lco* from=c->co;
+    c->co=to;
+    if(from!=to)
+    {
+        swapcontext(&from->uc, &to->uc);
+    }
+    //A finished coroutine is freed by whoever runs after it
+    if(c->dead)
+    {
+        lco_free(c->dead);
+        c->dead=NULL;
+    }
+}
+
+//Make everything waiting on ch ready to look at it again
+void lco_wake(lctx* c, lchan* ch)
+{
+    lco** p=&c->blocked;
+    while(*p)
+    {
+        lco* co=*p;
+        if(co->wait==ch)
+        {
+            *p=co->next;
+            co->wait=NULL;
+            lco_push(c, co);
+        }
+        else
+        {
+            p=&co->next;
+        }
+    }
+}
+
+//Wait until ch changes. FALSE if nothing else can run, so it never will.
+int lco_block(lctx* c, lchan* ch)
+{
+    lco* next=lco_pop(c);
+    if(!next)
+    {
+        return FALSE;
+    }
+    c->co->wait=ch;
+    c->co->next=c->blocked;
+    c->blocked=c->co;
+    lco_switch(c, next);
+    return TRUE;
+}
+
+void lco_entry(void)
+{
+    lctx* c=nisp_ctx;
+    //Started by setcontext rather than lco_switch, so free what finished
+    //just before this
+    if(c->dead)
+    {
+        lco_free(c->dead);
+        c->dead=NULL;
+    }
+    lco* co=c->co;
+    lval* f=co->f;
+    lval* a=co->a;
+    co->f=NULL;
+    lval* x=lval_call(c->env, f, a);
+    lval_del(f);
+    if(x->type==LVAL_ERR)
+    {
+        lval_println(x);
+    }
+    lval_del(x);
+
+    //If nothing else can run, main is blocked and has to find out
+    lco* next=lco_pop(c);
+    if(!next)
+    {
+        next=c->main;
+        lco** p=&c->blocked;
+        while(*p!=next)
+        {
+            p=&(*p)->next;
+        }
+        *p=next->next;
+        next->wait=NULL;
+    }
+    c->dead=co;
+    c->co=next;
+    setcontext(&next->uc);
+}
+
+//Run spawned coroutines from main until none of them can. Called once a
+//file or line has been evaluated.
+void lco_run(lctx* c)
+{
+    while(c->co && c->ready)
+    {
+        lco_push(c, c->co);
+        lco_switch(c, lco_pop(c));
+    }
+}
+
+void lco_del_all(lctx* c)
+{
+    //Coroutines left blocked mid call lose whatever is on their stacks
+    while(c->ready || c->blocked)
+    {
+        lco* co=c->ready ? lco_pop(c) : c->blocked;
+        if(co==c->blocked)
+        {
+            c->blocked=co->next;
+        }
+        if(co!=c->main)
+        {
+            lco_free(co);
+        }
+    }
+    free(c->main);
+}
+
+//Bounded channels, shared between copies
+lchan* lchan_new(int cap)
+{
+    lchan* ch=calloc(1, sizeof(lchan));
+    ch->refs=1;
+    ch->cap=cap;
+    ch->items=malloc(sizeof(lval*) * cap);
+    return ch;
+}
+
+void lchan_del(lchan* ch)
+{
+    if(__atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL)>0)
+    {
+        return;
+    }
+    for(int i=0; i<ch->count; i++)
+    {
+        lval_del(ch->items[(ch->head+i)%ch->cap]);
+    }
+    free(ch->items);
+    free(ch);
+}
+
+lval* lval_chan(lchan* ch)
+{
+    lval* v=lval_new(LVAL_CHAN);
+    v->chan=ch;
+    return v;
+}
+
+//(spawn f args...) calls f with args in a new coroutine, in the global env
+lval* builtin_spawn(lenv* e, lval* a)
+{
+    LASSERT(a, a->count>=1, "Function 'spawn' passed no arguments");
+    LASSERT_TYPE("spawn", a, 0, LVAL_FUN);
+    lctx* c=nisp_ctx;
+    lco* co=calloc(1, sizeof(lco));
+    co->stack=mmap(NULL, LCO_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(co->stack==MAP_FAILED)
+    {
+        free(co);
+        lval_del(a);
+        return lval_err("Could not allocate a coroutine stack");
+    }
+    //Guard page, so running off the end faults rather than corrupting
+    if(mprotect(co->stack, 4096, PROT_NONE)<0)
+    {
+        munmap(co->stack, LCO_STACK);
+        free(co);
+        lval_del(a);
+        return lval_err("Could not allocate a coroutine stack");
+    }
+    getcontext(&co->uc);
+    co->uc.uc_stack.ss_sp=co->stack;
+    co->uc.uc_stack.ss_size=LCO_STACK;
+    co->uc.uc_link=NULL;
+    makecontext(&co->uc, lco_entry, 0);
+    co->f=lval_pop(a, 0);
+    co->a=a;
+    if(!c->main)
+    {
+        c->main=calloc(1, sizeof(lco));
+        c->co=c->main;
+    }
+    lco_push(c, co);
+    return lval_sexpr();
+}
+
+//(yield x) lets every other ready coroutine run, then returns x
+lval* builtin_yield(lenv* e, lval* a)
+{
+    LASSERT_NUM("yield", a, 1);
+    lctx* c=nisp_ctx;
+    if(c->co && c->ready)
+    {
+        lco_push(c, c->co);
+        lco_switch(c, lco_pop(c));
+    }
+    return lval_take(a, 0);
+}
+
+lval* builtin_chan(lenv* e, lval* a)
+{
+    LASSERT_NUM("chan", a, 1);
+    LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num>=1 && a->cell[0]->num<=INT_MAX, "Function 'chan' needs a capacity of at least 1");
+    lval* x=lval_chan(lchan_new((int) a->cell[0]->num));
+    lval_del(a);
+    return x;
+}
+
+//(chan-send c x) waits while c is full
+lval* builtin_chan_send(lenv* e, lval* a)
+{
+    LASSERT_NUM("chan-send", a, 2);
+    LASSERT_TYPE("chan-send", a, 0, LVAL_CHAN);
+    lchan* ch=a->cell[0]->chan;
+    while(ch->count==ch->cap && !ch->closed)
+    {
+        LASSERT(a, lco_block(nisp_ctx, ch), "Deadlock, sending on a full channel nothing will receive from");
+    }
+    LASSERT(a, !ch->closed, "Function 'chan-send' sent on a closed channel");
+    ch->items[(ch->head+ch->count++)%ch->cap]=lval_pop(a, 1);
+    lco_wake(nisp_ctx, ch);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//(chan-recv c) waits while c is empty, and returns {} once it is closed
+//and drained
+lval* builtin_chan_recv(lenv* e, lval* a)
+{
+    LASSERT_NUM("chan-recv", a, 1);
+    LASSERT_TYPE("chan-recv", a, 0, LVAL_CHAN);
+    lchan* ch=a->cell[0]->chan;
+    while(ch->count==0 && !ch->closed)
+    {
+        LASSERT(a, lco_block(nisp_ctx, ch), "Deadlock, receiving on an empty channel nothing will send to");
+    }
+    lval* x;
+    if(ch->count)
+    {
+        x=ch->items[ch->head];
+        ch->head=(ch->head+1)%ch->cap;
+        ch->count--;
+        lco_wake(nisp_ctx, ch);
+    }
+    else
+    {
+        x=lval_qexpr();
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_chan_close(lenv* e, lval* a)
+{
+    LASSERT_NUM("chan-close", a, 1);
+    LASSERT_TYPE("chan-close", a, 0, LVAL_CHAN);
+    a->cell[0]->chan->closed=TRUE;
+    lco_wake(nisp_ctx, a->cell[0]->chan);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/************************************************************
+**************************RECORDS****************************
+************************************************************/
+
+//(defrecord {point x y}) defines a constructor (point 1 2), a predicate
+//point? and an accessor per field, point-x and point-y. The slots are a
+//fixed array shared between copies, so passing a record around and reading
+//a field are O(1) whatever its size. update returns a changed record.
+enum { LREC_NEW=-1, LREC_IS=-2 };
+
+lrec* lrec_new(lrtype* t)
+{
+    lrec* r=lheap_alloc(sizeof(lrec)+sizeof(lval*)*t->count);
+    r->refs=1;
+    r->type=t;
+    r->next=NULL;
+    r->count=t->count;
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_ACQ_REL);
+    return r;
+}
+
+void lrtype_del(lrtype* t)
+{
+    if(__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)>0)
+    {
+        return;
+    }
+    for(int i=0; i<t->count; i++)
+    {
+        free(t->fields[i]);
+    }
+    free(t->fields);
+    free(t->name);
+    free(t);
+}
+
+//Records nested in slots go on a per-thread list rather than the C stack
+static __thread lrec* lrec_pending;
+static __thread int lrec_freeing;
+
+void lrec_del(lrec* r)
+{
+    if(__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL)>0)
+    {
+        return;
+    }
+    r->next=lrec_pending;
+    lrec_pending=r;
+    if(lrec_freeing)
+    {
+        return;
+    }
+    lrec_freeing=TRUE;
+    while(lrec_pending)
+    {
+        lrec* x=lrec_pending;
+        lrec_pending=x->next;
+        for(int i=0; i<x->count; i++)
+        {
+            lval_del(x->slots[i]);
+        }
+        lrtype_del(x->type);
+        lheap_free(x);
+    }
+    lrec_freeing=FALSE;
+}
+
+lval* lval_rec(lrec* r)
+{
+    lval* v=lval_new(LVAL_REC);
+    v->rec=r;
+    return v;
+}
+
+//Stands in for the C function of record functions, which lval_call hands
+//to lrec_apply along with their type
+lval* builtin_record(lenv* e, lval* a)
+{
+    lval_del(a);
+    return lval_err("Record function called without its type");
+}
+
+lval* lrec_fun(lrtype* t, int kind)
+{
+    lval* v=lval_builtin(builtin_record);
+    v->rtype=t;
+    v->kind=kind;
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_ACQ_REL);
+    return v;
+}
+
+//Call a constructor, predicate or accessor made by defrecord
+lval* lrec_apply(lval* f, lval* a)
+{
+    lrtype* t=f->rtype;
+    int kind=f->kind;
+    if(kind==LREC_NEW)
+    {
+        LASSERT_CODE(a, a->count==t->count, LERR_ARGS, "Function '%s' received bad number of args.\nRecieved: %i\nExpected: %i", t->name, a->count, t->count);
+        lrec* r=lrec_new(t);
+        for(int i=0; i<a->count; i++)
+        {
+            r->slots[i]=a->cell[i];
+        }
+        a->count=0;
+        lval_del(a);
+        return lval_rec(r);
+    }
+    if(kind==LREC_IS)
+    {
+        LASSERT_CODE(a, a->count==1, LERR_ARGS, "Function '%s?' received bad number of args.\nRecieved: %i\nExpected: 1", t->name, a->count);
+        lval* x=lval_num(a->cell[0]->type==LVAL_REC && a->cell[0]->rec->type==t);
+        lval_del(a);
+        return x;
+    }
+    LASSERT_CODE(a, a->count==1, LERR_ARGS, "Function '%s-%s' received bad number of args.\nRecieved: %i\nExpected: 1", t->name, t->fields[kind], a->count);
+    LASSERT_CODE(a, a->cell[0]->type==LVAL_REC && a->cell[0]->rec->type==t, LERR_TYPE, "Function '%s-%s' expected a %s record.\nRecieved: %s", t->name, t->fields[kind], t->name, ltype_name(a->cell[0]->type));
+    lval* x=lval_copy(a->cell[0]->rec->slots[kind]);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_defrecord(lenv* e, lval* a)
+{
+    LASSERT_NUM("defrecord", a, 1);
+    LASSERT_TYPE("defrecord", a, 0, LVAL_QEXPR);
+    lval* q=a->cell[0];
+    LASSERT(a, q->count>=1, "Function 'defrecord' passed no record name");
+    for(int i=0; i<q->count; i++)
+    {
+        LASSERT(a, q->cell[i]->type==LVAL_SYM, "Function 'defrecord' cannot define non-symbolic value.\nReceived: %s\nExpected: %s", ltype_name(q->cell[i]->type), ltype_name(LVAL_SYM));
+        for(int j=1; j<i; j++)
+        {
+            LASSERT(a, strcmp(q->cell[i]->sym, q->cell[j]->sym)!=0, "Function 'defrecord' given field '%s' twice", q->cell[i]->sym);
+        }
+    }
+    lrtype* t=malloc(sizeof(lrtype));
+    t->refs=1;
+    t->name=malloc(strlen(q->cell[0]->sym)+1);
+    strcpy(t->name, q->cell[0]->sym);
+    t->count=q->count-1;
+    t->fields=malloc(sizeof(char*)*t->count);
+    for(int i=0; i<t->count; i++)
+    {
+        t->fields[i]=malloc(strlen(q->cell[i+1]->sym)+1);
+        strcpy(t->fields[i], q->cell[i+1]->sym);
+    }
+    lbuf b={NULL, 0, 0};
+    for(int i=LREC_IS; i<t->count; i++)
+    {
+        b.len=0;
+        lbuf_puts(&b, t->name);
+        if(i==LREC_IS)
+        {
+            lbuf_putc(&b, '?');
+        }
+        else if(i>=0)
+        {
+            lbuf_putc(&b, '-');
+            lbuf_puts(&b, t->fields[i]);
+        }
+        lbuf_putc(&b, '\0');
+        lval* k=lval_sym(b.data);
+        lval* f=lrec_fun(t, i);
+        lenv_def(e, k, f);
+        lval_del(k);
+        lval_del(f);
+    }
+    free(b.data);
+    lrtype_del(t);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//(update r {field...} values...) returns r with those fields replaced
+lval* builtin_update(lenv* e, lval* a)
+{
+    LASSERT(a, a->count>=2, "Function 'update' passed too few arguments");
+    LASSERT_TYPE("update", a, 0, LVAL_REC);
+    LASSERT_TYPE("update", a, 1, LVAL_QEXPR);
+    lrec* r=a->cell[0]->rec;
+    lval* q=a->cell[1];
+    LASSERT_CODE(a, q->count==a->count-2, LERR_ARGS, "Function 'update' received %i fields and %i values", q->count, a->count-2);
+    int* at=malloc(sizeof(int)*q->count);
+    for(int i=0; i<q->count; i++)
+    {
+        at[i]=-1;
+        for(int j=0; q->cell[i]->type==LVAL_SYM && j<r->count; j++)
+        {
+            if(strcmp(q->cell[i]->sym, r->type->fields[j])==0)
+            {
+                at[i]=j;
+                break;
+            }
+        }
+        if(at[i]<0)
+        {
+            lval* err=q->cell[i]->type==LVAL_SYM
+                ? lval_errc(LERR_ARGS, "Record %s has no field '%s'", r->type->name, q->cell[i]->sym)
+                : lval_errc(LERR_TYPE, "Function 'update' cannot update non-symbolic field.\nReceived: %s\nExpected: %s", ltype_name(q->cell[i]->type), ltype_name(LVAL_SYM));
+            free(at);
+            lval_del(a);
+            return err;
+        }
+    }
+    //Reuse the slots when nothing else shares them
+    lrec* n=r;
+    if(__atomic_load_n(&r->refs, __ATOMIC_ACQUIRE)==1)
+    {
+        __atomic_add_fetch(&r->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    else
+    {
+        n=lrec_new(r->type);
+        for(int i=0; i<r->count; i++)
+        {
+            n->slots[i]=lval_copy(r->slots[i]);
+        }
+    }
+    for(int i=0; i<q->count; i++)
+    {
+        lval_del(n->slots[at[i]]);
+        n->slots[at[i]]=a->cell[i+2];
+        a->cell[i+2]=lval_sexpr();
+    }
+    free(at);
+    lval_del(a);
+    return lval_rec(n);
+}
+
+/************************************************************
+**************************BUDGETS****************************
+************************************************************/
+
+#define LBUDGET_CHUNK 1024
+
+//Out of fuel: check every limit, then hand out the next chunk of steps
+int lbudget_check(lctx* c)
+{
+    long left=c->max_steps-c->steps;
+    long held=c->stats.bytes;
+    long max_bytes=c->max_bytes;
+    if(c->share)
+    {
+        //A pmap worker takes its steps from the pool it shares with the
+        //others and adds its heap to theirs, so together they keep to the
+        //caller's budget
+        held=__atomic_add_fetch(&c->share->bytes, c->stats.bytes-c->shared, __ATOMIC_ACQ_REL);
+        c->shared=c->stats.bytes;
+        max_bytes=c->share->max_bytes;
+        left=c->over==LOVER_NONE ? __atomic_fetch_sub(&c->share->steps, LBUDGET_CHUNK, __ATOMIC_ACQ_REL) : 0;
+    }
+    if(c->over==LOVER_NONE)
+    {
+        if(left<=0)
+        {
+            c->over=LOVER_STEPS;
+        }
+        else if(held > max_bytes)
+        {
+            c->over=LOVER_HEAP;
+        }
+        else if(c->deadline && lnow() > c->deadline)
+        {
+            c->over=LOVER_TIME;
+        }
+    }
+    if(c->over!=LOVER_NONE)
+    {
+        c->fuel=0;
+        return TRUE;
+    }
+#ifndef NISP_LIBRARY
+    if(c->server)
+    {
+        lserver_yield(c->server);
+    }
+#endif
+    long chunk=left < LBUDGET_CHUNK ? left : LBUDGET_CHUNK;
+    c->steps+=chunk;
+    c->fuel=chunk-1;
+    return FALSE;
+}
+
+//Settle the steps handed out but not used, so the next one rechecks
+void lctx_settle(lctx* c)
+{
+    c->steps-=c->fuel;
+    c->fuel=0;
+}
+
+//Tighten the limits in force to b, counted from now. Heap is measured in
+//bytes held by values, envs and sequences at once, see lheap_alloc.
+void lctx_limit(lctx* c, lbudget b)
+{
+    lctx_settle(c);
+    if(b.steps>0 && b.steps < c->max_steps-c->steps)
+    {
+        c->max_steps=c->steps+b.steps;
+        c->limit.steps=b.steps;
+    }
+    if(b.bytes>0 && (c->max_bytes==LONG_MAX || b.bytes < c->max_bytes-c->stats.bytes))
+    {
+        c->max_bytes=c->stats.bytes+b.bytes;
+        c->limit.bytes=b.bytes;
+    }
+    double deadline=lnow()+b.seconds;
+    if(b.seconds>0 && (!c->deadline || deadline < c->deadline))
+    {
+        c->deadline=deadline;
+        c->limit.seconds=b.seconds;
+    }
+}
+
+//Start a top level evaluation: a REPL line, a file, a request
+void lctx_begin(lctx* c)
+{
+    c->limit=c->budget;
+    c->steps=0;
+    c->fuel=0;
+    c->max_steps=LONG_MAX;
+    c->max_bytes=LONG_MAX;
+    c->deadline=0;
+    c->over=LOVER_NONE;
+    lctx_limit(c, c->budget);
+}
+
+//Called once over budget. Every eval after this fails too, until the
+//evaluation ends or the enclosing budget call returns.
+lval* lbudget_err(lctx* c)
+{
+    switch(c->over)
+    {
+        case LOVER_STEPS:
+            return lval_errc(LERR_LIMIT, "Step limit of %.0f exceeded", (double) c->limit.steps);
+        case LOVER_HEAP:
+            return lval_errc(LERR_LIMIT, "Heap limit of %.0f bytes exceeded", (double) c->limit.bytes);
+        default:
+            return lval_errc(LERR_LIMIT, "Time limit of %gs exceeded", c->limit.seconds);
+    }
+}
+
+//budget steps bytes seconds {body}, evaluating body under the tighter of
+//these limits and the ones already in force. 0 leaves a limit as it is.
+lval* builtin_budget(lenv* e, lval* a)
+{
+    LASSERT_NUM("budget", a, 4);
+    LASSERT_TYPE("budget", a, 0, LVAL_NUM);
+    LASSERT_TYPE("budget", a, 1, LVAL_NUM);
+    LASSERT_TYPE("budget", a, 2, LVAL_NUM);
+    LASSERT_TYPE("budget", a, 3, LVAL_QEXPR);
+    lctx* c=nisp_ctx;
+    lbudget limit=c->limit;
+    long max_steps=c->max_steps;
+    long max_bytes=c->max_bytes;
+    double deadline=c->deadline;
+    int over=c->over;
+    lbudget b={(long) a->cell[0]->num, (long) a->cell[1]->num, a->cell[2]->num};
+    lctx_limit(c, b);
+    lval* body=lval_pop(a, 3);
+    body->type=LVAL_SEXPR;
+    lval_del(a);
+    lval* x=lval_eval(e, body);
+    //The body may end on the allocation that went over
+    if(x->type!=LVAL_ERR && c->over==LOVER_NONE && c->stats.bytes > c->max_bytes)
+    {
+        c->over=LOVER_HEAP;
+        lval_del(x);
+        x=lbudget_err(c);
+    }
+    lctx_settle(c);
+    c->limit=limit;
+    c->max_steps=max_steps;
+    c->max_bytes=max_bytes;
+    c->deadline=deadline;
+    c->over=over;
+    return x;
+}
+
+//Adding builtin functions to REPL
+
+/************************************************************
+*******************BUILTIN_DESCRIPTORS***********************
+************************************************************/
+
+//Every builtin checks its own arguments, since it can be called with
+//anything. Where the checks are just an argument count and types, they are
+//also described here, and lval_call compares those directly and calls the
+//unchecked entry point, without the builtin working out which operation it
+//is or formatting anything. A call that doesn't fit goes to the builtin,
+//so it fails with the same error as ever.
+const lbdesc lbdescs[]=
+{
+    {builtin_add, LBD_VARIADIC, {LVAL_NUM}, lnum_add, TRUE},
+    {builtin_sub, LBD_VARIADIC, {LVAL_NUM}, lnum_sub, TRUE},
+    {builtin_mul, LBD_VARIADIC, {LVAL_NUM}, lnum_mul, TRUE},
+    {builtin_div, LBD_VARIADIC, {LVAL_NUM}, lnum_div, TRUE},
+    {builtin_mod, LBD_VARIADIC, {LVAL_NUM}, lnum_mod, TRUE},
+    {builtin_pow, LBD_VARIADIC, {LVAL_NUM}, lnum_pow, TRUE},
+    {builtin_gt, 2, {LVAL_NUM, LVAL_NUM}, lnum_gt, TRUE},
+    {builtin_lt, 2, {LVAL_NUM, LVAL_NUM}, lnum_lt, TRUE},
+    {builtin_ge, 2, {LVAL_NUM, LVAL_NUM}, lnum_ge, TRUE},
+    {builtin_le, 2, {LVAL_NUM, LVAL_NUM}, lnum_le, TRUE},
+    {builtin_eq, 2, {LBD_ANY, LBD_ANY}, lcmp_eq, TRUE},
+    {builtin_ne, 2, {LBD_ANY, LBD_ANY}, lcmp_ne, TRUE},
+    //These also need a non-empty list, which isn't described
+    {builtin_head, 1, {LVAL_QEXPR}, NULL, TRUE},
+    {builtin_tail, 1, {LVAL_QEXPR}, NULL, TRUE},
+    {builtin_join, LBD_VARIADIC, {LVAL_QEXPR}, NULL, TRUE},
+    {builtin_if, 3, {LVAL_NUM, LVAL_QEXPR, LVAL_QEXPR}, NULL, FALSE},
+    {builtin_eval, 1, {LVAL_QEXPR}, NULL, FALSE},
+    {builtin_str_find, 2, {LVAL_STR, LVAL_STR}, NULL, TRUE},
+    {builtin_str_count, 2, {LVAL_STR, LVAL_STR}, NULL, TRUE},
+    {builtin_str_split, 2, {LVAL_STR, LVAL_STR}, NULL, TRUE},
+    {builtin_str_starts_with, 2, {LVAL_STR, LVAL_STR}, NULL, TRUE},
+    {builtin_str_match, 2, {LVAL_STR, LVAL_STR}, NULL, TRUE},
+};
+
+const lbdesc* lbdesc_find(lbuiltin f)
+{
+    for(int i=0; i<(int) (sizeof(lbdescs)/sizeof(lbdescs[0])); i++)
+    {
+        if(lbdescs[i].f==f)
+        {
+            return &lbdescs[i];
+        }
+    }
+    return NULL;
+}
+
+//Whether the arguments a are what d describes
+int lbdesc_fits(const lbdesc* d, lval* a)
+{
+    if(d->argc==LBD_VARIADIC ? a->count<1 : a->count!=d->argc)
+    {
+        return FALSE;
+    }
+    for(int i=0; i<a->count; i++)
+    {
+        int t=d->types[d->argc==LBD_VARIADIC ? 0 : i];
+        if(t!=LBD_ANY && a->cell[i]->type!=t)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func)
+{
+    lval* k=lval_sym(name);
+    lval* v=lval_fun(func);
+    v->desc=lbdesc_find(func);
+    lenv_put(e,k,v);
+    lval_del(k);
+    lval_del(v);
+}
+
+void lenv_add_builtins(lenv* e)
+{
+    //Library support
+    lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "try", builtin_try);
+    lenv_add_builtin(e, "budget", builtin_budget);
+    lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "to-string", builtin_to_string);
+
+    //Var declaration
+    lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+
+    //Q-Expression operations
+    lenv_add_builtin(e, "list", builtin_list);
+    lenv_add_builtin(e, "head", builtin_head);
+    lenv_add_builtin(e, "tail", builtin_tail);
+    lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "=", builtin_put);
+
+    //Math
+    lenv_add_builtin(e, "add", builtin_add);
+    lenv_add_builtin(e, "sub", builtin_sub);
+    lenv_add_builtin(e, "mul", builtin_mul);
+    lenv_add_builtin(e, "div", builtin_div);
+    lenv_add_builtin(e, "mod", builtin_mod);
+    lenv_add_builtin(e, "pow", builtin_pow);
+    lenv_add_builtin(e, "+", builtin_add);
+    lenv_add_builtin(e, "-", builtin_sub);
+    lenv_add_builtin(e, "*", builtin_mul);
+    lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
+    lenv_add_builtin(e, "^", builtin_pow);
+
+    //Logical
+    lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "while", builtin_while);
+    lenv_add_builtin(e, "dotimes", builtin_dotimes);
+    lenv_add_builtin(e, "loop", builtin_loop);
+    lenv_add_builtin(e, "recur", builtin_recur);
+    lenv_add_builtin(e, ">", builtin_gt);
+    lenv_add_builtin(e, "<", builtin_lt);
+    lenv_add_builtin(e, ">=", builtin_ge);
+    lenv_add_builtin(e, "<=", builtin_le);
+    lenv_add_builtin(e, "==", builtin_eq);
+    lenv_add_builtin(e, "!=", builtin_ne);
+    lenv_add_builtin(e, "greater", builtin_gt);
+    lenv_add_builtin(e, "less", builtin_lt);
+    lenv_add_builtin(e, "equal", builtin_eq);
+
+    //Parallel
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "pfilter", builtin_pfilter);
+    lenv_add_builtin(e, "preduce", builtin_preduce);
+
+    //Lazy sequences
+    lenv_add_builtin(e, "range", builtin_range);
+    lenv_add_builtin(e, "iterate", builtin_iterate);
+    lenv_add_builtin(e, "repeat", builtin_repeat);
+    lenv_add_builtin(e, "lines-of-file", builtin_lines_of_file);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "realize", builtin_realize);
+    lenv_add_builtin(e, "fold", builtin_fold);
+
+    //Files
+    lenv_add_builtin(e, "read-file", builtin_read_file);
+    lenv_add_builtin(e, "write-file", builtin_write_file);
+    lenv_add_builtin(e, "read-lines", builtin_read_lines);
+    lenv_add_builtin(e, "read-csv", builtin_read_csv);
+    lenv_add_builtin(e, "require", builtin_require);
+
+    //Strings
+    lenv_add_builtin(e, "str-find", builtin_str_find);
+    lenv_add_builtin(e, "str-count", builtin_str_count);
+    lenv_add_builtin(e, "str-split", builtin_str_split);
+    lenv_add_builtin(e, "str-starts-with", builtin_str_starts_with);
+    lenv_add_builtin(e, "str-match", builtin_str_match);
+
+    //Coroutines
+    lenv_add_builtin(e, "spawn", builtin_spawn);
+    lenv_add_builtin(e, "yield", builtin_yield);
+    lenv_add_builtin(e, "chan", builtin_chan);
+    lenv_add_builtin(e, "chan-send", builtin_chan_send);
+    lenv_add_builtin(e, "chan-recv", builtin_chan_recv);
+    lenv_add_builtin(e, "chan-close", builtin_chan_close);
+
+    //Records
+    lenv_add_builtin(e, "defrecord", builtin_defrecord);
+    lenv_add_builtin(e, "update", builtin_update);
+}
+
+/************************************************************
+***********************CONTEXTS******************************
+************************************************************/
+
+//Create a context with its own grammar and global env. Output goes to out.
+lctx* lctx_new(FILE* out)
+{
+    lctx* c=malloc(sizeof(lctx));
+    c->out=out;
+    c->snapshot=NULL;
+    memset(&c->stats, 0, sizeof(lstats));
+    c->syms=calloc(1, sizeof(lsymtab));
+    pthread_mutex_init(&c->syms->lock, NULL);
+    c->version=0;
+    c->caching=TRUE;
+    c->jits=NULL;
+    c->mods=NULL;
+    c->snapshot_mods=NULL;
+    c->recur=NULL;
+    c->main=NULL;
+    c->co=NULL;
+    c->ready=NULL;
+    c->ready_tail=NULL;
+    c->blocked=NULL;
+    c->dead=NULL;
+    c->server=NULL;
+    c->share=NULL;
+    c->shared=0;
+    c->budget=nisp_budget;
+    lctx_begin(c);
+    c->Number  = mpc_new("number"); 
+    c->Symbol  = mpc_new("symbol"); 
+    c->String  = mpc_new("string"); 
+    c->Comment = mpc_new("comment"); 
+    c->Sexpr   = mpc_new("sexpr"); 
+    c->Qexpr   = mpc_new("qexpr"); 
+    c->Expr    = mpc_new("expr"); 
+    c->Lispy   = mpc_new("lispy"); 
+    //Language & Grammar
+    mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                      \
+        number  : /-?[0-9]*\\.[0-9]+/ | /-?[0-9]+/;        \
+        symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=><!&\\^%?]+/;    \
+        string  : /\"(\\\\.|[^\"])*\"/;                    \
+        comment : /;[^\\r\\n]*/;                           \
+        sexpr   : '(' <expr>* ')';                         \
+        qexpr   : '{' <expr>* '}';                         \
+        expr    : <number> | <symbol> | <sexpr>            \
+                  | <comment> | <qexpr> | <string>;        \
+        lispy   : /^/ <expr>* /$/;                         \
+    ",
+    c->Number, c->Symbol, c->String, c->Comment, c->Sexpr, c->Qexpr, c->Expr, c->Lispy);
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    c->env=lenv_new();
+    lenv_add_builtins(c->env);
+    nisp_ctx=old;
+    return c;
+}
+
+void lctx_del(lctx* c)
+{
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    lco_del_all(c);
+    if(c->recur)
+    {
+        lval_del(c->recur);
+    }
+    while(c->mods)
+    {
+        lmod* m=c->mods;
+        c->mods=m->next;
+        lmod_del(m);
+    }
+    lenv_del(c->env);
+    if(c->snapshot)
+    {
+        lenv_del(c->snapshot);
+    }
+    nisp_ctx=old;
+    mpc_cleanup(8, c->Number, c->Symbol, c->Sexpr, c->Qexpr, c->Expr, c->Lispy, c->String, c->Comment);
+    for(int i=0; i<LSYM_BUCKETS; i++)
+    {
+        while(c->syms->buckets[i])
+        {
+            lsym* s=c->syms->buckets[i];
+            c->syms->buckets[i]=s->next;
+            free(s->name);
+            free(s);
+        }
+    }
+    while(c->jits)
+    {
+        ljit* j=c->jits;
+        c->jits=j->next;
+        ljit_del(j);
+    }
+    pthread_mutex_destroy(&c->syms->lock);
+    free(c->syms);
+    free(c);
+}
+
+void lctx_print_stats(lctx* c, char* name)
+{
+    fprintf(stderr, "%s: %ld allocs, %ld frees, %ld live\n", name, c->stats.allocs, c->stats.frees, c->stats.allocs-c->stats.frees);
+    fprintf(stderr, "%s: %ld symbol cache hits, %ld misses\n", name, c->stats.hits, c->stats.misses);
+    if(nisp_hashcons)
+    {
+        fprintf(stderr, "%s: %zu hash consed values\n", name, lhc_table.count);
+    }
+    if(nisp_jit)
+    {
+        fprintf(stderr, "%s: %ld native calls, %ld bailed to the interpreter\n", name, c->stats.jit_calls, c->stats.jit_bails);
+    }
+}
+
+//Load a file into the current context, printing any error
+void lctx_load(char* file)
+{
+    lctx_begin(nisp_ctx);
+    lval* args=lval_add(lval_sexpr(), lval_str(file));
+    lval* x=builtin_load(nisp_ctx->env, args);
+    if(x->type==LVAL_ERR)
+    {
+        lval_println(x);
+    }
+    lval_del(x);
+    lco_run(nisp_ctx);
+}
+
+/************************************************************
+****************************AOT******************************
+************************************************************/
+
+//Runtime for programs written by nisp --compile, see AOT_COMPILER. The
+//program is a table of its top level forms, each with the native code of
+//the lambda it defines when that lambda compiled to C.
+typedef struct
+{
+    lval* (*form)(void);
+    char* name;
+    int (*code)(double*, double*);
+    int argc;
+    char** deps; //globals the code relies on, NULL terminated
+} laot_form;
+
+lval* laot_global(lctx* c, char* name)
+{
+    for(int i=0; i<c->env->count; i++)
+    {
+        if(strcmp(c->env->syms[i], name)==0)
+        {
+            return c->env->vals[i];
+        }
+    }
+    return NULL;
+}
+
+//Give the global lambda f defines its native code, as --jit would, once
+//every global the code calls is bound. The usual ljit checks drop back to
+//the interpreter if any of them are redefined later.
+int laot_attach(lctx* c, laot_form* f)
+{
+    lval* fn=laot_global(c, f->name);
+    if(!fn || fn->type!=LVAL_FUN || fn->builtin || fn->formals->count!=f->argc)
+    {
+        return FALSE;
+    }
+    int n=0;
+    for(; f->deps[n]; n++)
+    {
+        if(!laot_global(c, f->deps[n]))
+        {
+            return FALSE;
+        }
+    }
+    ljit* j=calloc(1, sizeof(ljit));
+    j->code=(unsigned char*) f->code;
+    j->argc=f->argc;
+    j->ndeps=n;
+    j->deps=malloc(sizeof(lsym*) * n);
+    j->gens=malloc(sizeof(long) * n);
+    for(int i=0; i<n; i++)
+    {
+        j->deps[i]=lsym_intern(c->syms, f->deps[i]);
+        j->gens[i]=j->deps[i]->gen;
+    }
+    j->next=c->jits;
+    c->jits=j;
+    fn->jit=j;
+    return TRUE;
+}
+
+//main of a compiled program. Forms are evaluated in order like a loaded
+//file, printing any error.
+int laot_main(laot_form* forms, int n)
+{
+    nisp_threads=(int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(getenv("NISP_THREADS"))
+    {
+        nisp_threads=atoi(getenv("NISP_THREADS"));
+    }
+    if(nisp_threads<1)
+    {
+        nisp_threads=1;
+    }
+    lctx* c=lctx_new(stdout);
+    nisp_ctx=c;
+    int* attached=calloc(n, sizeof(int));
+    for(int i=0; i<n; i++)
+    {
+        lctx_begin(c);
+        lval* x=lval_eval(c->env, forms[i].form());
+        if(x->type==LVAL_ERR)
+        {
+            lval_println(x);
+        }
+        lval_del(x);
+        for(int k=0; k<=i; k++)
+        {
+            if(forms[k].code && !attached[k])
+            {
+                attached[k]=laot_attach(c, &forms[k]);
+            }
+        }
+    }
+    free(attached);
+    lco_run(c);
+    lctx_del(c);
+    return 0;
+}
+
+/************************************************************
+*************************EMBEDDING***************************
+************************************************************/
+
+lctx* nisp_new(void)
+{
+    return lctx_new(stdout);
+}
+
+void nisp_del(lctx* c)
+{
+    lctx_del(c);
+}
+
+void nisp_output(lctx* c, FILE* out)
+{
+    c->out=out;
+}
+
+lval* nisp_load(lctx* c, char* file)
+{
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    lctx_begin(c);
+    lval* x=builtin_load(c->env, lval_add(lval_sexpr(), lval_str(file)));
+    lco_run(c);
+    nisp_ctx=old;
+    return x;
+}
+
+lval* nisp_eval(lctx* c, char* src)
+{
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    lval* x;
+    mpc_result_t r;
+    if(mpc_parse("<eval>", src, c->Lispy, &r))
+    {
+        lctx_begin(c);
+        x=lval_eval(c->env, lval_read(r.output));
+        mpc_ast_delete(r.output);
+        lco_run(c);
+    }
+    else
+    {
+        char* err_msg=mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        x=lval_errc(LERR_LOAD, "Could not parse %s", err_msg);
+        free(err_msg);
+    }
+    nisp_ctx=old;
+    return x;
+}
+
+void nisp_limit(lctx* c, long steps, long bytes, double seconds)
+{
+    lbudget b={steps, bytes, seconds};
+    c->budget=b;
+}
+
+void nisp_register(lctx* c, char* name, lbuiltin func)
+{
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    lenv_add_builtin(c->env, name, func);
+    nisp_ctx=old;
+}
+
+void nisp_snapshot(lctx* c)
+{
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    if(c->snapshot)
+    {
+        lenv_del(c->snapshot);
+    }
+    c->snapshot=lenv_copy(c->env);
+    c->snapshot_mods=c->mods;
+    nisp_ctx=old;
+}
+
+void nisp_reset(lctx* c)
+{
+    lctx* old=nisp_ctx;
+    nisp_ctx=c;
+    //Modules required since the snapshot go along with their bindings, so
+    //a later require evaluates them again. The others stay loaded, over
+    //the restored env.
+    lmod* keep=c->snapshot ? c->snapshot_mods : NULL;
+    while(c->mods!=keep)
+    {
+        lmod* m=c->mods;
+        c->mods=m->next;
+        lmod_del(m);
+    }
+    lenv_del(c->env);
+    c->version++;
+    if(c->snapshot)
+    {
+        c->env=lenv_copy(c->snapshot);
+    }
+    else
+    {
+        c->env=lenv_new();
+        lenv_add_builtins(c->env);
+    }
+    for(lmod* m=c->mods; m; m=m->next)
+    {
+        m->env->par=c->env;
+    }
+    nisp_ctx=old;
+}
+
+#ifndef NISP_LIBRARY
+
+/************************************************************
+************************EVAL_SERVER**************************
+************************************************************/
+
+//A client of the eval server. Each connection evaluates in its own root
+//env over the preloaded global env, so definitions don't leak between
+//clients.
+typedef struct
+{
+    int fd;
+    lenv* env;
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    char* out;
+    size_t out_len;
+    size_t out_off;
+    double start; //when the pending request began arriving, or it went idle
+} lconn;
+
+//How long a request evaluates before the server looks at its sockets again
+#define LSERVE_SLICE 0.005
+//The largest request, and how much a client may have sent but not had
+//evaluated yet. Clients going over are closed.
+#define LSERVE_MAX_REQUEST (64*1024*1024)
+#define LSERVE_MAX_BUFFER (2*LSERVE_MAX_REQUEST)
+
+struct lserver
+{
+    int lfd;
+    int ep;
+    lconn** conns;
+    int count;
+    double timeout;
+    double polled; //when the sockets were last looked at
+    int pending; //read while a request evaluated, so not processed yet
+};
+
+//Evaluate one request, appending its printed output and result to the
+//connection's write buffer. Length-framed requests get a length-framed reply.
+void lconn_eval(lconn* c, char* src, int framed)
+{
+    char* buf;
+    size_t len;
+    FILE* out=open_memstream(&buf, &len);
+    FILE* old=nisp_ctx->out;
+    nisp_ctx->out=out;
+    if(!c->env)
+    {
+        c->env=lenv_new();
+        c->env->par=nisp_ctx->env;
+        c->env->root=TRUE;
+    }
+    mpc_result_t r;
+    if(mpc_parse("<socket>", src, nisp_ctx->Lispy, &r))
+    {
+        //A request, and whatever it spawns, has until the timeout. The
+        //server keeps up with its other sockets while it runs.
+        lbudget b={0, 0, nisp_ctx->server->timeout};
+        lctx_begin(nisp_ctx);
+        lctx_limit(nisp_ctx, b);
+        lval* x=lval_eval(c->env, lval_read(r.output));
+        mpc_ast_delete(r.output);
+        lco_run(nisp_ctx);
+        lval_println(x);
+        lval_del(x);
+    }
+    else
+    {
+        char* err_msg=mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        fprintf(out, "Error: %s\n", err_msg);
+        free(err_msg);
+    }
+    nisp_ctx->out=old;
+    fclose(out);
+    char head[32];
+    int head_len=framed ? sprintf(head, "#%zu\n", len) : 0;
+    c->out=realloc(c->out, c->out_len+head_len+len);
+    memcpy(c->out+c->out_len, head, head_len);
+    memcpy(c->out+c->out_len+head_len, buf, len);
+    c->out_len+=head_len+len;
+    free(buf);
+}
+
+int lconn_flush(lconn* c);
+
+//Tell a client why, as best the socket allows, and mark it to be closed
+void lconn_reject(lconn* c, char* msg)
+{
+    size_t len=strlen(msg);
+    c->out=realloc(c->out, c->out_len+len+9);
+    c->out_len+=sprintf(c->out+c->out_len, "Error: %s\n", msg);
+    lconn_flush(c);
+    c->fd=-c->fd-1;
+}
+
+//Split complete requests off the read buffer. A request is either a line,
+//or '#' followed by a byte count, a newline and that many bytes.
+void lconn_process(lconn* c)
+{
+    size_t pos=0;
+    while(pos<c->in_len && c->fd>=0)
+    {
+        char* p=c->in+pos;
+        size_t avail=c->in_len-pos;
+        char* nl=memchr(p, '\n', avail);
+        if(!nl)
+        {
+            if(avail>LSERVE_MAX_REQUEST)
+            {
+                lconn_reject(c, "Request too long");
+            }
+            break;
+        }
+        size_t head=nl-p+1;
+        size_t len=head-1;
+        int framed=(p[0]=='#');
+        if(framed)
+        {
+            len=strtoul(p+1, NULL, 10);
+            if(!isdigit((unsigned char) p[1]) || len>LSERVE_MAX_REQUEST)
+            {
+                lconn_reject(c, "Bad request length");
+                break;
+            }
+            if(len>avail-head)
+            {
+                break;
+            }
+            p+=head;
+            head+=len;
+        }
+        else if(len && p[len-1]=='\r')
+        {
+            len--;
+        }
+        char* src=malloc(len+1);
+        memcpy(src, p, len);
+        src[len]='\0';
+        pos+=head;
+        if(framed || len)
+        {
+            //The read buffer may grow while this evaluates
+            lconn_eval(c, src, framed);
+        }
+        free(src);
+    }
+    if(pos)
+    {
+        //Whatever is left is the start of the next request
+        memmove(c->in, c->in+pos, c->in_len-pos);
+        c->in_len-=pos;
+        c->start=lnow();
+    }
+}
+
+//Write as much pending output as the socket takes, FALSE on a dead socket
+int lconn_flush(lconn* c)
+{
+    while(c->out_off<c->out_len)
+    {
+        ssize_t n=send(c->fd, c->out+c->out_off, c->out_len-c->out_off, MSG_NOSIGNAL);
+        if(n<0)
+        {
+            return errno==EAGAIN || errno==EWOULDBLOCK;
+        }
+        c->out_off+=n;
+    }
+    free(c->out);
+    c->out=NULL;
+    c->out_len=0;
+    c->out_off=0;
+    return TRUE;
+}
+
+void lconn_close(lconn* c)
+{
+    close(c->fd);
+    if(c->env)
+    {
+        lenv_del(c->env);
+    }
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+//Flush c, and wait to write the rest once the socket takes it. Dead
+//connections are only marked here, and closed by lserve.
+void lserver_watch(lserver* s, lconn* c)
+{
+    if(c->fd<0)
+    {
+        return;
+    }
+    if(!lconn_flush(c))
+    {
+        c->fd=-c->fd-1;
+        return;
+    }
+    struct epoll_event ev;
+    ev.events=EPOLLIN | (c->out_len ? EPOLLOUT : 0);
+    ev.data.ptr=c;
+    epoll_ctl(s->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+//Accept new clients, read what they sent and write what they are owed,
+//waiting up to wait milliseconds for anything to happen. Requests are only
+//buffered here, lserve evaluates them.
+void lserver_poll(lserver* s, int wait)
+{
+    struct epoll_event events[64];
+    int n=epoll_wait(s->ep, events, 64, wait);
+    s->polled=lnow();
+    for(int i=0; i<n; i++)
+    {
+        lconn* c=events[i].data.ptr;
+        if(!c)
+        {
+            int fd;
+            while((fd=accept4(s->lfd, NULL, NULL, SOCK_NONBLOCK))>=0)
+            {
+                c=calloc(1, sizeof(lconn));
+                c->fd=fd;
+                c->start=s->polled;
+                struct epoll_event ev;
+                ev.events=EPOLLIN;
+                ev.data.ptr=c;
+                epoll_ctl(s->ep, EPOLL_CTL_ADD, fd, &ev);
+                s->conns=realloc(s->conns, sizeof(lconn*) * (s->count+1));
+                s->conns[s->count++]=c;
+            }
+            continue;
+        }
+        if(c->fd<0)
+        {
+            continue;
+        }
+        if(events[i].events & EPOLLIN)
+        {
+            //The timeout runs from the first byte of a request, not the last
+            if(!c->in_len)
+            {
+                c->start=s->polled;
+            }
+            while(TRUE)
+            {
+                if(c->in_cap-c->in_len<BUF_SIZE)
+                {
+                    c->in_cap=c->in_cap*2+BUF_SIZE;
+                    c->in=realloc(c->in, c->in_cap);
+                }
+                ssize_t r=read(c->fd, c->in+c->in_len, c->in_cap-c->in_len);
+                if(r>0)
+                {
+                    c->in_len+=r;
+                    s->pending=TRUE;
+                    if(c->in_len>LSERVE_MAX_BUFFER)
+                    {
+                        lconn_reject(c, "Too much sent at once");
+                        break;
+                    }
+                    continue;
+                }
+                if(!(r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)))
+                {
+                    c->fd=-c->fd-1;
+                }
+                break;
+            }
+        }
+        if(c->fd>=0 && (events[i].events & (EPOLLERR | EPOLLHUP)))
+        {
+            c->fd=-c->fd-1;
+        }
+        lserver_watch(s, c);
+    }
+}
+
+//Called between chunks of steps of a request, so one that runs long
+//doesn't stop the server accepting, reading and writing for the others
+void lserver_yield(lserver* s)
+{
+    if(lnow()-s->polled > LSERVE_SLICE)
+    {
+        lserver_poll(s, 0);
+    }
+}
+
+//Serve eval requests on a Unix socket until killed. Requests are evaluated
+//one at a time, and each may run for up to timeout seconds. Connections
+//with a request incomplete, or nothing sent, for that long are closed.
+int lserve(char* path, double timeout)
+{
+    lserver s;
+    memset(&s, 0, sizeof(s));
+    s.timeout=timeout;
+    s.lfd=socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+    if(s.lfd<0 || bind(s.lfd, (struct sockaddr*) &addr, sizeof(addr))<0 || listen(s.lfd, 128)<0)
+    {
+        perror(path);
+        return 1;
+    }
+    s.ep=epoll_create1(0);
+    struct epoll_event ev;
+    ev.events=EPOLLIN;
+    ev.data.ptr=NULL;
+    epoll_ctl(s.ep, EPOLL_CTL_ADD, s.lfd, &ev);
+    nisp_ctx->server=&s;
+
+    while(TRUE)
+    {
+        lserver_poll(&s, 1000);
+        //Until nothing more arrived while evaluating, so no one waiting on
+        //an answer is timed out for it. Connections accepted meanwhile are
+        //appended, and seen too.
+        while(s.pending)
+        {
+            s.pending=FALSE;
+            for(int i=0; i<s.count; i++)
             {
-                lval_del(v->cell[i]);
+                lconn* c=s.conns[i];
+                if(c->fd>=0 && c->in_len)
+                {
+                    lconn_process(c);
+                    lserver_watch(&s, c);
+                }
             }
-            free(v->cell);
-            break;
-        case LVAL_FUN:
-            if(!v->builtin)
+        }
+        //Drop closed and timed out connections
+        double now=lnow();
+        int kept=0;
+        for(int i=0; i<s.count; i++)
+        {
+            lconn* c=s.conns[i];
+            if(c->fd<0)
             {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
+                c->fd=-c->fd-1;
+                lconn_close(c);
+                continue;
             }
-            break;
-        case LVAL_STR:
-            free(v->str);
-            break;
+            if(now-c->start>timeout)
+            {
+                lconn_close(c);
+                continue;
+            }
+            s.conns[kept++]=c;
+        }
+        s.count=kept;
     }
-    free(v);
 }
 
-lval* lval_lambda(lval* formals, lval* body)
+//Load generator for the eval server: clients threads each send requests
+//round trips of expr, then the throughput and latency percentiles are printed
+typedef struct
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_FUN;
-    v->builtin=NULL;
-    v->env=lenv_new();
-    v->formals=formals;
-    v->body=body;
-    return v;
+    char* path;
+    char* expr;
+    int requests;
+    double* latency;
+} lloadgen;
+
+void* lloadgen_client(void* arg)
+{
+    lloadgen* g=arg;
+    int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strncpy(addr.sun_path, g->path, sizeof(addr.sun_path)-1);
+    if(connect(fd, (struct sockaddr*) &addr, sizeof(addr))<0)
+    {
+        perror(g->path);
+        exit(1);
+    }
+    char head[32];
+    int head_len=sprintf(head, "#%zu\n", strlen(g->expr));
+    //Replies can be any size, so the buffer grows to fit
+    lbuf buf={NULL, 0, 0};
+    for(int i=0; i<g->requests; i++)
+    {
+        double t=lnow();
+        if(write(fd, head, head_len)<0 || write(fd, g->expr, strlen(g->expr))<0)
+        {
+            exit(1);
+        }
+        //Read the reply's length header, then its body
+        buf.len=0;
+        size_t want=0;
+        char* body=NULL;
+        while(!body || buf.len<want)
+        {
+            lbuf_reserve(&buf, BUF_SIZE);
+            ssize_t r=read(fd, buf.data+buf.len, buf.cap-buf.len);
+            if(r<=0)
+            {
+                exit(1);
+            }
+            buf.len+=r;
+            body=memchr(buf.data, '\n', buf.len);
+            if(body)
+            {
+                want=(body-buf.data)+1+strtoul(buf.data+1, NULL, 10);
+            }
+        }
+        g->latency[i]=lnow()-t;
+    }
+    free(buf.data);
+    close(fd);
+    return NULL;
 }
 
-//Function type creation
-lval* lval_fun(lbuiltin func)
+int ldouble_cmp(const void* a, const void* b)
 {
-    lval* v=malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin = func;
-    return v;
+    double x=*(double*) a;
+    double y=*(double*) b;
+    return (x>y)-(x<y);
 }
 
-//Number type creation
-lval* lval_num(double x)
+int lloadgen_run(char* path, int clients, int requests, char* expr)
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_NUM;
-    v->num=x;
-    return v;
+    lloadgen* gs=malloc(sizeof(lloadgen) * clients);
+    pthread_t* threads=malloc(sizeof(pthread_t) * clients);
+    double* latency=malloc(sizeof(double) * clients * requests);
+    double t=lnow();
+    for(int i=0; i<clients; i++)
+    {
+        gs[i].path=path;
+        gs[i].expr=expr;
+        gs[i].requests=requests;
+        gs[i].latency=latency+i*requests;
+        pthread_create(&threads[i], NULL, lloadgen_client, &gs[i]);
+    }
+    for(int i=0; i<clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    t=lnow()-t;
+    int total=clients*requests;
+    qsort(latency, total, sizeof(double), ldouble_cmp);
+    printf("%d requests in %.3fs: %.0f req/s, p50 %.1fus, p99 %.1fus\n", total, t, total/t, latency[total/2]*1e6, latency[(int) (total*0.99)]*1e6);
+    free(latency);
+    free(threads);
+    free(gs);
+    return 0;
 }
 
-//Error type creation
-lval* lval_err(char* fmt, ...)
+//Script state for -j, every script gets an isolated context
+typedef struct
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_ERR;
-    va_list va;
-    va_start(va, fmt);
-    v->err=malloc(512);
-    vsnprintf(v->err, 511, fmt, va);
-    v->err=realloc(v->err, strlen(v->err)+1);
-    va_end(va);
-    return v;
+    char* file;
+    char* buf;
+    size_t len;
+    int done;
+} lscript;
+
+typedef struct
+{
+    lscript* scripts;
+    int count;
+    int next;
+    int stats;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} lbatch;
+
+void* lbatch_worker(void* arg)
+{
+    lbatch* b=arg;
+    while(TRUE)
+    {
+        pthread_mutex_lock(&b->lock);
+        int i=b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if(i>=b->count)
+        {
+            return NULL;
+        }
+        lscript* s=&b->scripts[i];
+        //Buffer the whole script's output so it is never interleaved
+        FILE* out=open_memstream(&s->buf, &s->len);
+        lctx* c=lctx_new(out);
+        nisp_ctx=c;
+        lctx_load(s->file);
+        if(b->stats)
+        {
+            lctx_print_stats(c, s->file);
+        }
+        lctx_del(c);
+        nisp_ctx=NULL;
+        fclose(out);
+        pthread_mutex_lock(&b->lock);
+        s->done=TRUE;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
 }
 
-//Symbol type creation
-lval* lval_sym(char* s)
+//Evaluate files on up to jobs threads, writing output in argv order
+void lbatch_run(char** files, int count, int jobs, int stats)
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_SYM;
-    v->sym=malloc(strlen(s)+1);
-    strcpy(v->sym, s);
-    return v;
+    lbatch b;
+    b.scripts=calloc(count, sizeof(lscript));
+    b.count=count;
+    b.next=0;
+    b.stats=stats;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+    for(int i=0; i<count; i++)
+    {
+        b.scripts[i].file=files[i];
+    }
+    if(jobs>count)
+    {
+        jobs=count;
+    }
+    pthread_t* threads=malloc(sizeof(pthread_t) * jobs);
+    for(int i=0; i<jobs; i++)
+    {
+        pthread_create(&threads[i], NULL, lbatch_worker, &b);
+    }
+    for(int i=0; i<count; i++)
+    {
+        pthread_mutex_lock(&b.lock);
+        while(!b.scripts[i].done)
+        {
+            pthread_cond_wait(&b.cond, &b.lock);
+        }
+        pthread_mutex_unlock(&b.lock);
+        fwrite(b.scripts[i].buf, 1, b.scripts[i].len, stdout);
+        fflush(stdout);
+        free(b.scripts[i].buf);
+    }
+    for(int i=0; i<jobs; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
+    free(b.scripts);
 }
 
-//String type creation
-lval* lval_str(char* s)
+/************************************************************
+***********************AOT_COMPILER**************************
+************************************************************/
+
+//nisp --compile app.nsp -o app.c writes a C program that builds each top
+//level form directly rather than parsing it, and evaluates it in the
+//interpreter nisp.c provides as a library. Loads of literal file names
+//are inlined. Lambdas defined at the top level with fun or def that stay
+//inside the subset --jit handles also become C functions on doubles,
+//attached to the lambda as its native code.
+
+typedef struct
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_STR;
-    v->str=malloc(strlen(s)+1);
-    strcpy(v->str, s);
-    return v;
+    char* name;
+    lval* formals; //copy, without the name fun takes
+    lval* body;
+    int form;
+    int ok;
+    lval* deps; //Q-Expression of the global symbols the code uses
+    lbuf code;
+} laot_fn;
+
+typedef struct
+{
+    lval* forms;
+    laot_fn* fns;
+    int nfns;
+    laot_fn* fn; //being compiled
+    int temps;
+} laot;
+
+laot_fn* laot_find(laot* a, char* name)
+{
+    for(int i=0; i<a->nfns; i++)
+    {
+        if(a->fns[i].ok && strcmp(a->fns[i].name, name)==0)
+        {
+            return &a->fns[i];
+        }
+    }
+    return NULL;
 }
 
-lval* lval_builtin(lbuiltin func)
+void laot_dep(lval* deps, char* name)
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_FUN;
-    v->builtin=func;
-    return v;
+    for(int i=0; i<deps->count; i++)
+    {
+        if(strcmp(deps->cell[i]->sym, name)==0)
+        {
+            return;
+        }
+    }
+    lval_add(deps, lval_sym(name));
 }
 
-//S-Expression creation
-lval* lval_sexpr(void)
+//How many top level forms bind name with def, = or fun
+int laot_bound(laot* a, char* name)
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_SEXPR;
-    v->count=0;
-    v->cell=NULL;
-    return v;
+    int n=0;
+    for(int i=0; i<a->forms->count; i++)
+    {
+        lval* v=a->forms->cell[i];
+        if(v->type!=LVAL_SEXPR || v->count<2 || v->cell[0]->type!=LVAL_SYM || v->cell[1]->type!=LVAL_QEXPR)
+        {
+            continue;
+        }
+        char* op=v->cell[0]->sym;
+        int fun=(strcmp(op, "fun")==0);
+        if(!fun && strcmp(op, "def")!=0 && strcmp(op, "=")!=0)
+        {
+            continue;
+        }
+        for(int k=0; k<v->cell[1]->count && (k==0 || !fun); k++)
+        {
+            lval* sym=v->cell[1]->cell[k];
+            n+=(sym->type==LVAL_SYM && strcmp(sym->sym, name)==0);
+        }
+    }
+    return n;
 }
 
-//Q-Expression creation
-lval* lval_qexpr(void)
+int laot_expr(laot* a, lval* v);
+
+//Compile the elements of an S-Expression, returning the temporary that
+//holds its value, or -1 if it is outside the subset
+int laot_sexpr(laot* a, lval* v)
 {
-    lval* v=malloc(sizeof(lval));
-    v->type=LVAL_QEXPR;
-    v->count=0;
-    v->cell=NULL;
-    return v;
+    laot_fn* fn=a->fn;
+    lbuf* b=&fn->code;
+    if(v->count==1)
+    {
+        return laot_expr(a, v->cell[0]);
+    }
+    if(v->count<2 || v->cell[0]->type!=LVAL_SYM)
+    {
+        return -1;
+    }
+    char* head=v->cell[0]->sym;
+    for(int i=0; i<fn->formals->count; i++)
+    {
+        if(strcmp(fn->formals->cell[i]->sym, head)==0)
+        {
+            return -1;
+        }
+    }
+    int argc=v->count-1;
+    int t=a->temps++;
+
+    laot_fn* callee=laot_find(a, head);
+    if(callee)
+    {
+        if(callee->formals->count!=argc)
+        {
+            return -1;
+        }
+        int args[argc];
+        for(int i=0; i<argc; i++)
+        {
+            if((args[i]=laot_expr(a, v->cell[i+1]))<0)
+            {
+                return -1;
+            }
+        }
+        lbuf_printf(b, "    double t%i;\n    if(!nisp_fn_%i((double[]) {", t, (int) (callee-a->fns));
+        for(int i=0; i<argc; i++)
+        {
+            lbuf_printf(b, i ? ", t%i" : "t%i", args[i]);
+        }
+        lbuf_printf(b, "}, &t%i))\n    {\n        return 0;\n    }\n", t);
+        laot_dep(fn->deps, head);
+        return t;
+    }
+
+    //Builtins the program rebinds are left to the interpreter
+    lval* f=laot_global(nisp_ctx, head);
+    if(!f || f->type!=LVAL_FUN || !f->builtin || laot_bound(a, head))
+    {
+        return -1;
+    }
+    lbuiltin op=f->builtin;
+    laot_dep(fn->deps, head);
+
+    if(op==builtin_if)
+    {
+        if(argc!=3 || v->cell[2]->type!=LVAL_QEXPR || v->cell[3]->type!=LVAL_QEXPR)
+        {
+            return -1;
+        }
+        int c=laot_expr(a, v->cell[1]);
+        if(c<0)
+        {
+            return -1;
+        }
+        lbuf_printf(b, "    double t%i;\n    if(t%i)\n    {\n", t, c);
+        int x=laot_sexpr(a, v->cell[2]);
+        if(x<0)
+        {
+            return -1;
+        }
+        lbuf_printf(b, "    t%i=t%i;\n    }\n    else\n    {\n", t, x);
+        int y=laot_sexpr(a, v->cell[3]);
+        if(y<0)
+        {
+            return -1;
+        }
+        lbuf_printf(b, "    t%i=t%i;\n    }\n", t, y);
+        return t;
+    }
+
+    if(op==builtin_add || op==builtin_sub || op==builtin_mul || op==builtin_div || op==builtin_pow)
+    {
+        int x=laot_expr(a, v->cell[1]);
+        if(x<0)
+        {
+            return -1;
+        }
+        lbuf_printf(b, "    double t%i=t%i;\n", t, x);
+        for(int i=2; i<v->count; i++)
+        {
+            int y=laot_expr(a, v->cell[i]);
+            if(y<0)
+            {
+                return -1;
+            }
+            if(op==builtin_add) { lbuf_printf(b, "    t%i+=t%i;\n", t, y); }
+            if(op==builtin_sub) { lbuf_printf(b, "    t%i-=t%i;\n", t, y); }
+            if(op==builtin_mul) { lbuf_printf(b, "    t%i*=t%i;\n", t, y); }
+            if(op==builtin_pow) { lbuf_printf(b, "    t%i=pow(t%i, t%i);\n", t, t, y); }
+            if(op==builtin_div)
+            {
+                //The interpreter redoes the call and raises divide by zero
+                lbuf_printf(b, "    if(t%i==0)\n    {\n        return 0;\n    }\n    t%i/=t%i;\n", y, t, y);
+            }
+        }
+        return t;
+    }
+
+    char* cmp=op==builtin_gt ? ">" : op==builtin_lt ? "<" : op==builtin_ge ? ">="
+        : op==builtin_le ? "<=" : op==builtin_eq ? "==" : op==builtin_ne ? "!=" : NULL;
+    if(cmp)
+    {
+        int x, y;
+        if(argc!=2 || (x=laot_expr(a, v->cell[1]))<0 || (y=laot_expr(a, v->cell[2]))<0)
+        {
+            return -1;
+        }
+        lbuf_printf(b, "    double t%i=t%i%st%i;\n", t, x, cmp, y);
+        return t;
+    }
+    return -1;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v)
+int laot_expr(laot* a, lval* v)
 {
-    for(int i=0;i<v->count;i++)
+    laot_fn* fn=a->fn;
+    if(v->type==LVAL_NUM)
     {
-        v->cell[i]=lval_eval(e, v->cell[i]);
+        int t=a->temps++;
+        lbuf_printf(&fn->code, "    double t%i=%.17g;\n", t, v->num);
+        return t;
     }
-    for(int i=0;i<v->count;i++)
+    if(v->type==LVAL_SYM)
     {
-        if(v->cell[i]->type==LVAL_ERR)
+        for(int i=0; i<fn->formals->count; i++)
         {
-            return lval_take(v,i);
+            if(strcmp(fn->formals->cell[i]->sym, v->sym)==0)
+            {
+                int t=a->temps++;
+                lbuf_printf(&fn->code, "    double t%i=a[%i];\n", t, i);
+                return t;
+            }
         }
+        return -1;
     }
-    if(v->count==0)
+    if(v->type==LVAL_SEXPR)
     {
-        return v;
+        return laot_sexpr(a, v);
     }
-    if(v->count==1)
+    return -1;
+}
+
+int laot_syms(lval* q)
+{
+    for(int i=0; i<q->count; i++)
     {
-        return lval_eval(e, lval_take(v,0));
+        if(q->cell[i]->type!=LVAL_SYM || strcmp(q->cell[i]->sym, "&")==0)
+        {
+            return FALSE;
+        }
     }
-    lval* f=lval_pop(v,0);
-    if(f->type!=LVAL_FUN)
+    return TRUE;
+}
+
+//Whether v defines a lambda by (fun {name args...} {body}) or
+//(def {name} (\ {args...} {body}))
+int laot_defines(lval* v, char** name, lval** formals, lval** body)
+{
+    if(v->type!=LVAL_SEXPR || v->count!=3 || v->cell[0]->type!=LVAL_SYM || v->cell[1]->type!=LVAL_QEXPR)
     {
-        lval* err=lval_err("S-Expression begins with invalid type.\n" "Received: %s\nExpected: %s", ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f);
-        lval_del(v);
-        return err;
+        return FALSE;
+    }
+    lval* k=v->cell[1];
+    lval* x=v->cell[2];
+    if(strcmp(v->cell[0]->sym, "fun")==0 && k->count>1 && laot_syms(k) && x->type==LVAL_QEXPR)
+    {
+        *name=k->cell[0]->sym;
+        *formals=lval_copy(k);
+        lval_del(lval_pop(*formals, 0));
+        *body=x;
+        return TRUE;
+    }
+    if(strcmp(v->cell[0]->sym, "def")==0 && k->count==1 && laot_syms(k)
+        && x->type==LVAL_SEXPR && x->count==3 && x->cell[0]->type==LVAL_SYM && strcmp(x->cell[0]->sym, "\\")==0
+        && x->cell[1]->type==LVAL_QEXPR && x->cell[1]->count>0 && laot_syms(x->cell[1]) && x->cell[2]->type==LVAL_QEXPR)
+    {
+        *name=k->cell[0]->sym;
+        *formals=lval_copy(x->cell[1]);
+        *body=x->cell[2];
+        return TRUE;
+    }
+    return FALSE;
+}
+
+//Read a file's forms into a->forms, inlining (load "file")
+lval* laot_read(laot* a, char* file)
+{
+    lval* expr=lmod_read(file, FALSE);
+    if(expr->type==LVAL_ERR)
+    {
+        return expr;
+    }
+    while(expr->count)
+    {
+        lval* x=lval_pop(expr, 0);
+        if(x->type==LVAL_SEXPR && x->count==2 && x->cell[0]->type==LVAL_SYM
+            && strcmp(x->cell[0]->sym, "load")==0 && x->cell[1]->type==LVAL_STR)
+        {
+            lval* err=laot_read(a, x->cell[1]->str);
+            lval_del(x);
+            if(err)
+            {
+                lval_del(expr);
+                return err;
+            }
+            continue;
+        }
+        lval_add(a->forms, x);
+    }
+    lval_del(expr);
+    return NULL;
+}
+
+//Statements building v into s[depth]
+void laot_build(lbuf* b, lval* v, int depth, int* max)
+{
+    if(depth>*max)
+    {
+        *max=depth;
+    }
+    switch(v->type)
+    {
+        case LVAL_NUM:
+            lbuf_printf(b, "    s[%i]=lval_num(%.17g);\n", depth, v->num);
+            return;
+        case LVAL_SYM:
+        case LVAL_STR:
+            lbuf_printf(b, "    s[%i]=lval_%s(\"", depth, v->type==LVAL_SYM ? "sym" : "str");
+            for(unsigned char* p=(unsigned char*) (v->type==LVAL_SYM ? v->sym : v->str); *p; p++)
+            {
+                if(*p=='"' || *p=='\\' || *p=='?' || *p<' ' || *p>'~')
+                {
+                    lbuf_printf(b, "\\%03o", *p);
+                }
+                else
+                {
+                    lbuf_putc(b, *p);
+                }
+            }
+            lbuf_puts(b, "\");\n");
+            return;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lbuf_printf(b, "    s[%i]=lval_%s();\n", depth, v->type==LVAL_SEXPR ? "sexpr" : "qexpr");
+            for(int i=0; i<v->count; i++)
+            {
+                laot_build(b, v->cell[i], depth+1, max);
+                lbuf_printf(b, "    lval_add(s[%i], s[%i]);\n", depth, depth+1);
+            }
+            return;
+        default:
+            //The reader never produces anything else
+            lbuf_printf(b, "    s[%i]=lval_sexpr();\n", depth);
+            return;
     }
-    lval* result=lval_call(e, f, v);
-    lval_del(f);
-    return result;
 }
 
-lval* builtin_lambda(lenv* e, lval* a)
+int laot_compile(char* in, char* out)
 {
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
-    for(int i=0; i<a->cell[0]->count; i++)
+    laot a;
+    memset(&a, 0, sizeof(laot));
+    a.forms=lval_sexpr();
+    lval* err=laot_read(&a, in);
+    if(err)
     {
-        LASSERT(a, a->cell[0]->cell[i]->type==LVAL_SYM, "Cannot define non-symbolic object.\nRecieved: %s\nExpected: %s", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+        lval_println(err);
+        lval_del(err);
+        lval_del(a.forms);
+        return 1;
     }
-    lval* formals=lval_pop(a,0);
-    lval* body=lval_pop(a,0);
-    lval_del(a);
-    return lval_lambda(formals, body);
-}
 
-lval* lval_eval(lenv* e, lval* v)
-{
-    if(v->type==LVAL_SYM)
+    //Lambdas bound once at the top level are candidates
+    a.fns=calloc(a.forms->count+1, sizeof(laot_fn));
+    for(int i=0; i<a.forms->count; i++)
     {
-        lval* x = lenv_get(e,v);
-        lval_del(v);
-        return x;
+        laot_fn* fn=&a.fns[a.nfns];
+        if(laot_defines(a.forms->cell[i], &fn->name, &fn->formals, &fn->body))
+        {
+            fn->form=i;
+            fn->ok=TRUE;
+            a.nfns++;
+        }
     }
-    if(v->type==LVAL_SEXPR)
+    for(int j=0; j<a.nfns; j++)
     {
-        return lval_eval_sexpr(e, v);
+        a.fns[j].ok=(laot_bound(&a, a.fns[j].name)==1);
     }
-    return v;
-}
 
-lval* lval_read_num(mpc_ast_t* t)
-{
-    errno=0;
-    double x=strtod(t->contents, NULL);
-    return errno!=ERANGE
-        ? lval_num(x)
-        : lval_err("Invalid number.");
-}
+    //Compile them all, dropping any that fail, until the set is stable
+    int changed=TRUE;
+    while(changed)
+    {
+        changed=FALSE;
+        for(int i=0; i<a.nfns; i++)
+        {
+            laot_fn* fn=&a.fns[i];
+            if(!fn->ok)
+            {
+                continue;
+            }
+            fn->code.len=0;
+            if(fn->deps)
+            {
+                lval_del(fn->deps);
+            }
+            fn->deps=lval_qexpr();
+            laot_dep(fn->deps, fn->name);
+            a.fn=fn;
+            a.temps=0;
+            lbuf_printf(&fn->code, "//%s\nstatic int nisp_fn_%i(double* a, double* r)\n{\n", fn->name, i);
+            lval* body=lval_copy(fn->body);
+            body->type=LVAL_SEXPR;
+            int t=laot_sexpr(&a, body);
+            lval_del(body);
+            if(t<0)
+            {
+                fn->ok=FALSE;
+                changed=TRUE;
+                continue;
+            }
+            lbuf_printf(&fn->code, "    *r=t%i;\n    return 1;\n}\n\n", t);
+        }
+    }
 
-lval* lval_read(mpc_ast_t* t)
-{
-    if(strstr(t->tag, "number"))
+    //Code is only valid while the code it calls is, so take on callees' deps
+    changed=TRUE;
+    while(changed)
     {
-        return lval_read_num(t);
+        changed=FALSE;
+        for(int i=0; i<a.nfns; i++)
+        {
+            laot_fn* fn=&a.fns[i];
+            for(int k=0; fn->ok && k<fn->deps->count; k++)
+            {
+                laot_fn* callee=laot_find(&a, fn->deps->cell[k]->sym);
+                for(int j=0; callee && j<callee->deps->count; j++)
+                {
+                    int before=fn->deps->count;
+                    laot_dep(fn->deps, callee->deps->cell[j]->sym);
+                    changed|=(fn->deps->count!=before);
+                }
+            }
+        }
     }
-    if(strstr(t->tag, "symbol"))
+
+    lbuf b={NULL, 0, 0};
+    lbuf_printf(&b, "//Generated by nisp --compile from %s. Build it in the nisp source\n", in);
+    lbuf_printf(&b, "//directory with: gcc -std=c99 -O2 -I. %s mpc/mpc.c -lm -lpthread\n", out);
+    lbuf_puts(&b, "#define NISP_LIBRARY\n#include \"nisp.c\"\n\n");
+    for(int i=0; i<a.nfns; i++)
     {
-        return lval_sym(t->contents);
+        if(a.fns[i].ok)
+        {
+            lbuf_printf(&b, "static int nisp_fn_%i(double* a, double* r);\n", i);
+        }
     }
-    lval* x=NULL;
-    if(strcmp(t->tag, ">")==0)
+    lbuf_putc(&b, '\n');
+    for(int i=0; i<a.nfns; i++)
     {
-        x=lval_sexpr();
+        if(a.fns[i].ok)
+        {
+            lbuf_write(&b, a.fns[i].code.data, a.fns[i].code.len);
+            lbuf_printf(&b, "static char* nisp_deps_%i[]={", i);
+            for(int k=0; k<a.fns[i].deps->count; k++)
+            {
+                lbuf_printf(&b, "\"%s\", ", a.fns[i].deps->cell[k]->sym);
+            }
+            lbuf_puts(&b, "NULL};\n\n");
+        }
     }
-    if(strstr(t->tag, "sexpr"))
+    for(int i=0; i<a.forms->count; i++)
     {
-        x=lval_sexpr();
+        lbuf f={NULL, 0, 0};
+        int max=0;
+        laot_build(&f, a.forms->cell[i], 0, &max);
+        lbuf_printf(&b, "static lval* nisp_form_%i(void)\n{\n    lval* s[%i];\n", i, max+1);
+        lbuf_write(&b, f.data, f.len);
+        lbuf_puts(&b, "    return s[0];\n}\n\n");
+        free(f.data);
     }
-    if(strstr(t->tag, "qexpr"))
+    lbuf_puts(&b, "static laot_form nisp_forms[]=\n{\n");
+    for(int i=0; i<a.forms->count; i++)
     {
-        x=lval_qexpr();
+        int k=0;
+        while(k<a.nfns && !(a.fns[k].ok && a.fns[k].form==i))
+        {
+            k++;
+        }
+        if(k<a.nfns)
+        {
+            lbuf_printf(&b, "    {nisp_form_%i, \"%s\", nisp_fn_%i, %i, nisp_deps_%i},\n", i, a.fns[k].name, k, a.fns[k].formals->count, k);
+        }
+        else
+        {
+            lbuf_printf(&b, "    {nisp_form_%i, NULL, NULL, 0, NULL},\n", i);
+        }
     }
-    if(strstr(t->tag, "string"))
+    lbuf_puts(&b, "};\n\nint main(void)\n{\n    return laot_main(nisp_forms, sizeof(nisp_forms)/sizeof(nisp_forms[0]));\n}\n");
+
+    int status=0;
+    FILE* f=fopen(out, "w");
+    if(!f || fwrite(b.data, 1, b.len, f)!=b.len)
     {
-        return lval_read_str(t);
+        fprintf(stderr, "Could not write %s\n", out);
+        status=1;
     }
-    for(int i=0; i<t->children_num; i++)
+    if(f && fclose(f)!=0)
     {
-        if(strcmp(t->children[i]->contents, "(")==0) {continue;}
-        if(strcmp(t->children[i]->contents, ")")==0) {continue;}
-        if(strcmp(t->children[i]->contents, "{")==0) {continue;}
-        if(strcmp(t->children[i]->contents, "}")==0) {continue;}
-        if(strcmp(t->children[i]->contents, "[")==0) {continue;}
-        if(strcmp(t->children[i]->contents, "]")==0) {continue;}
-        if(strcmp(t->children[i]->tag,  "regex")==0) {continue;}
-        if(strstr(t->children[i]->tag, "comment")) {continue;}
-        x=lval_add(x, lval_read(t->children[i]));
+        status=1;
     }
-    return x;
-}
-
-lval* lval_join(lval* x, lval* y)
-{
-    for(int i=0; i<y->count; i++)
+    int compiled=0;
+    for(int i=0; i<a.nfns; i++)
     {
-        x=lval_add(x,y->cell[i]);
+        compiled+=a.fns[i].ok;
+        free(a.fns[i].code.data);
+        lval_del(a.fns[i].formals);
+        if(a.fns[i].deps)
+        {
+            lval_del(a.fns[i].deps);
+        }
     }
-    free(y->cell);
-    free(y);
-    return x;
+    fprintf(stderr, "%s: %i forms, %i of %i functions compiled to C\n", out, a.forms->count, compiled, a.nfns);
+    free(a.fns);
+    free(b.data);
+    lval_del(a.forms);
+    return status;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a)
+int main(int argc, char** argv)
 {
-   if (f->builtin)
+    //Default to one worker per core, NISP_THREADS and -t override it
+    nisp_threads=(int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(getenv("NISP_THREADS"))
     {
-        return f->builtin(e, a);
+        nisp_threads=atoi(getenv("NISP_THREADS"));
     }
-    int given=a->count;
-    int total=f->formals->count;
-    while (a->count)
+    int jobs=0;
+    int stats=FALSE;
+    char* serve=NULL;
+    double timeout=30;
+    char* compile=NULL;
+    char* out="a.c";
+    //Strip flags from argv, leaving only the files to load
+    int files=1;
+    for(int i=1; i<argc; i++)
     {
-        if (f->formals->count==0)
+        if(strcmp(argv[i], "-t")==0 && i+1<argc)
         {
-            lval_del(a);
-            return lval_err("Function passed too many arguments.\nGot %i\nExpected %i\n", given, total);
+            nisp_threads=atoi(argv[++i]);
+            continue;
         }
-        lval* sym = lval_pop(f->formals, 0);
-        if (strcmp(sym->sym, "&")==0)
+        if(strcmp(argv[i], "-j")==0 && i+1<argc)
         {
-            if (f->formals->count!=1)
-            {
-                lval_del(a);
-                return lval_err("Function format invalid. " "Symbol '&' not followed by single symbol.");
-            }
-            lval* nsym=lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
-      }
-      lval* val=lval_pop(a, 0);
-      lenv_put(f->env, sym, val);
-      lval_del(sym);
-      lval_del(val);
-    }
-    lval_del(a);
-    if (f->formals->count>0 && strcmp(f->formals->cell[0]->sym, "&")==0)
-    {
-        if (f->formals->count!=2)
+            jobs=atoi(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--serve")==0 && i+1<argc)
         {
-            return lval_err("Function format invalid. " "Symbol '&' not followed by single symbol.");
+            serve=argv[++i];
+            continue;
         }
-        lval_del(lval_pop(f->formals, 0));
-        lval* sym=lval_pop(f->formals, 0);
-        lval* val=lval_qexpr();
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+        if(strcmp(argv[i], "--timeout")==0 && i+1<argc)
+        {
+            timeout=atof(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--loadgen")==0 && i+4<argc)
+        {
+            return lloadgen_run(argv[i+1], atoi(argv[i+2]), atoi(argv[i+3]), argv[i+4]);
+        }
+        if(strcmp(argv[i], "--jit")==0)
+        {
+            nisp_jit=TRUE;
+            continue;
+        }
+        if(strcmp(argv[i], "--hash-cons")==0)
+        {
+            nisp_hashcons=TRUE;
+            continue;
+        }
+        if(strncmp(argv[i], "-O", 2)==0)
+        {
+            nisp_opt=atoi(argv[i]+2);
+            continue;
+        }
+        if(strcmp(argv[i], "--max-steps")==0 && i+1<argc)
+        {
+            nisp_budget.steps=atol(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--max-heap")==0 && i+1<argc)
+        {
+            nisp_budget.bytes=atol(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--max-time")==0 && i+1<argc)
+        {
+            nisp_budget.seconds=atof(argv[++i]);
+            continue;
+        }
+        if(strcmp(argv[i], "--stats")==0)
+        {
+            stats=TRUE;
+            continue;
+        }
+        if(strcmp(argv[i], "--compile")==0 && i+1<argc)
+        {
+            compile=argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i], "-o")==0 && i+1<argc)
+        {
+            out=argv[++i];
+            continue;
+        }
+        argv[files++]=argv[i];
     }
-    if (f->formals->count==0)
+    argc=files;
+    if(nisp_threads<1)
     {
-        f->env->par=e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+        nisp_threads=1;
     }
-    else
+    if(argc>=2 && jobs>0)
     {
-        return lval_copy(f);
+        lbatch_run(argv+1, argc-1, jobs, stats);
+        return 0;
+    }
+    lctx* c=lctx_new(stdout);
+    nisp_ctx=c;
+    if(compile)
+    {
+        int status=laot_compile(compile, out);
+        lctx_del(c);
+        return status;
+    }
+    if(serve)
+    {
+        //Preload the files, then answer requests against them
+        for(int i=1; i<argc; i++)
+        {
+            lctx_load(argv[i]);
+        }
+        return lserve(serve, timeout);
     }
-
-}
-
-//Adding builtin functions to REPL
-
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func)
-{
-    lval* k=lval_sym(name);
-    lval* v=lval_fun(func);
-    lenv_put(e,k,v);
-    lval_del(k);
-    lval_del(v);
-}
-
-void lenv_add_builtins(lenv* e)
-{
-    //Library support
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "print", builtin_print);
-
-    //Var declaration
-    lenv_add_builtin(e, "def", builtin_def);
-
-    //Q-Expression operations
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, "=", builtin_put);
-
-    //Math
-    lenv_add_builtin(e, "add", builtin_add);
-    lenv_add_builtin(e, "sub", builtin_sub);
-    lenv_add_builtin(e, "mul", builtin_mul);
-    lenv_add_builtin(e, "div", builtin_div);
-    lenv_add_builtin(e, "mod", builtin_mod);
-    lenv_add_builtin(e, "pow", builtin_pow);
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
-    lenv_add_builtin(e, "^", builtin_pow);
-
-    //Logical
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "greater", builtin_gt);
-    lenv_add_builtin(e, "less", builtin_lt);
-    lenv_add_builtin(e, "equal", builtin_eq);
-}
-
-int main(int argc, char** argv)
-{
-    Number  = mpc_new("number"); 
-    Symbol  = mpc_new("symbol"); 
-    String  = mpc_new("string"); 
-    Comment = mpc_new("comment"); 
-    Sexpr   = mpc_new("sexpr"); 
-    Qexpr   = mpc_new("qexpr"); 
-    Expr    = mpc_new("expr"); 
-    Lispy   = mpc_new("lispy"); 
-    //Language & Grammar
-    mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                      \
-        number  : /-?[0-9]*\\.[0-9]+/ | /-?[0-9]+/;        \
-        symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=><!&\\^%]+/;    \
-        string  : /\"(\\\\.|[^\"])*\"/;                    \
-        comment : /;[^\\r\\n]*/;                           \
-        sexpr   : '(' <expr>* ')';                         \
-        qexpr   : '{' <expr>* '}';                         \
-        expr    : <number> | <symbol> | <sexpr>            \
-                  | <comment> | <qexpr> | <string>;        \
-        lispy   : /^/ <expr>* /$/;                         \
-    ",
-    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-    lenv* e=lenv_new();
-    lenv_add_builtins(e);
     if(argc==1)
     {
         puts("Nisp alpha\nctrl+c to exit\n");
@@ -1168,9 +7770,11 @@ int main(int argc, char** argv)
             add_history(input); //Add to history buffer
 
             mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lispy, &r)) //If the input matches the grammars provided, we will evaluate
+            if (mpc_parse("<stdin>", input, c->Lispy, &r)) //If the input matches the grammars provided, we will evaluate
             {
-                lval* x=lval_eval(e, lval_read(r.output));
+                lctx_begin(c);
+                lval* x=lval_eval(c->env, lval_read(r.output));
+                lco_run(c);
                 lval_println(x);
                 lval_del(x);
                 mpc_ast_delete(r.output);
@@ -1187,16 +7791,15 @@ int main(int argc, char** argv)
     {
         for(int i=1; i<argc; i++)
         {
-            lval* args=lval_add(lval_sexpr(), lval_str(argv[i]));
-            lval* x=builtin_load(e, args);
-            if(x->type==LVAL_ERR)
-            {
-                lval_println(x);
-            }
-            lval_del(x);
+            lctx_load(argv[i]);
         }
     }
-    lenv_del(e);
-    mpc_cleanup(8, Number, Symbol, Sexpr, Qexpr, Expr, Lispy, String, Comment);
+    if(stats)
+    {
+        lctx_print_stats(c, "nisp");
+    }
+    lctx_del(c);
     return 0;
 }
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef NISP_H
+#define NISP_H
+
+#include <stdio.h>
+
+//Embedding API for Nisp. Build libnisp.a/libnisp.so with compile.scr and
+//link with -lnisp -lm -lpthread.
+//
+//    lctx* c=nisp_new();
+//    lval_del(nisp_load(c, "stdlib.nsp"));
+//    nisp_snapshot(c);
+//    lval* x=nisp_eval(c, "len {1 2 3}");
+//    lval_del(x);
+//    nisp_reset(c);
+//    nisp_del(c);
+
+//Structs, typedefs, and enumerations
+struct lval;
+struct lenv;
+struct lctx;
+struct lsym;
+struct ljit;
+struct lfold;
+struct lerrfmt;
+struct lseq;
+struct lchan;
+struct lrec;
+struct lrtype;
+struct lbdesc;
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct lctx lctx;
+
+//Possible Lisp types
+enum { LVAL_ERR, LVAL_FUN, LVAL_NUM, LVAL_QEXPR, LVAL_SEXPR, LVAL_STR, LVAL_SYM, LVAL_SEQ, LVAL_CHAN, LVAL_REC };
+
+//Error codes, so a host can tell failures apart without reading messages
+enum { LERR_ERROR, LERR_USER, LERR_TYPE, LERR_ARGS, LERR_UNBOUND, LERR_DIV_ZERO, LERR_LOAD, LERR_LIMIT, LERR_RECUR };
+
+typedef lval*(*lbuiltin)(lenv*, lval*);
+
+//Lisp value. Only the payload for its type is set, the others share its
+//memory.
+struct lval
+{
+    int type;
+    union
+    {
+        double num;
+        struct //LVAL_ERR
+        {
+            int code;
+            char* err; //NULL until formatted, read it through lval_err_msg
+            struct lerrfmt* errfmt;
+        };
+        struct //LVAL_SYM
+        {
+            char* sym;
+            struct lsym* cache; //interned symbol, caches its global binding
+        };
+        char* str;
+        struct //LVAL_SEXPR and LVAL_QEXPR
+        {
+            int count;
+            struct lval** cell;
+        };
+        struct //LVAL_FUN
+        {
+            lbuiltin builtin; //NULL for a lambda
+            int macro; //lambda defined with defmacro
+            union
+            {
+                struct //builtin
+                {
+                    const struct lbdesc* desc; //arguments it accepts, NULL if not described
+                    struct lrtype* rtype; //record type of a constructor, predicate or accessor
+                    int kind; //which of those, with rtype
+                };
+                struct //lambda
+                {
+                    lenv* env;
+                    lval* formals;
+                    lval* body;
+                    struct ljit* jit; //native code, with --jit
+                    struct lfold* fold; //body as optimized when the lambda was made
+                };
+            };
+        };
+        struct lseq* seq; //lazy sequence, shared between copies
+        struct lchan* chan; //channel, shared between copies
+        struct lrec* rec; //record slots, shared between copies
+    };
+    int refs; //owners of a hash consed value, 0 for an ordinary one
+    int pins; //calls running the value straight from its binding
+    int retired; //unbound while pinned, freed when the last call ends
+};
+
+//Values. Builtins take ownership of their argument S-Expression and
+//return a new value, these are the helpers to build and free them.
+lval* lval_num(double x);
+lval* lval_str(char* s);
+lval* lval_sym(char* s);
+lval* lval_err(char* fmt, ...);
+lval* lval_errc(int code, char* fmt, ...);
+char* lval_err_msg(lval* v);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add(lval* v, lval* x);
+lval* lval_copy(lval* v);
+void lval_del(lval* v);
+void lval_print(lval* v);
+void lval_println(lval* v);
+
+//Contexts. Each context is independent, and may be used from any thread
+//as long as only one thread uses it at a time.
+lctx* nisp_new(void);
+void nisp_del(lctx* c);
+void nisp_output(lctx* c, FILE* out);
+
+//Load a file, returning () or the load error
+lval* nisp_load(lctx* c, char* file);
+//Evaluate a line of source the way the REPL does
+lval* nisp_eval(lctx* c, char* src);
+//Limit each later load or eval to a number of eval steps, bytes held by
+//values at once, and seconds. 0 is unlimited.
+void nisp_limit(lctx* c, long steps, long bytes, double seconds);
+//Add a native builtin to the global env
+void nisp_register(lctx* c, char* name, lbuiltin func);
+//Save the global env, and later restore it, dropping any definitions made
+//since. Without a snapshot, reset goes back to just the builtins.
+void nisp_snapshot(lctx* c);
+void nisp_reset(lctx* c);
+
+#endif
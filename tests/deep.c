@@ -0,0 +1,80 @@
+//Stress test for the value walkers: copy, compare, print and free a
+//Q-Expression nested a million deep, which would overflow the C stack if
+//any of them recursed. Build libnisp.a with compile.scr, then from the nisp
+//directory
+//
+//    gcc -std=c99 -I. tests/deep.c libnisp.a -lm -lpthread -o deep && ./deep
+//
+//It prints each check and exits non-zero if any fails.
+
+#include <stdio.h>
+#include <string.h>
+#include "nisp.h"
+
+#define DEPTH 1000000
+
+static int failed=0;
+
+//{{{...{}...}}}, DEPTH levels around an empty Q-Expression
+static lval* deep;
+
+//(deep x) returns a copy of deep
+static lval* builtin_deep(lenv* e, lval* a)
+{
+    lval_del(a);
+    return lval_copy(deep);
+}
+
+//Evaluate src, which should give a number or ()
+static void check(lctx* c, char* src, char* want)
+{
+    char got[256];
+    lval* x=nisp_eval(c, src);
+    if(x->type==LVAL_NUM)
+    {
+        snprintf(got, sizeof(got), "%g", x->num);
+    }
+    else if(x->type==LVAL_ERR)
+    {
+        snprintf(got, sizeof(got), "Error: %s", lval_err_msg(x));
+    }
+    else
+    {
+        snprintf(got, sizeof(got), x->type==LVAL_SEXPR && !x->count ? "()" : "<type %d>", x->type);
+    }
+    lval_del(x);
+    int ok=(strcmp(got, want)==0);
+    printf("%s %s => %s\n", ok ? "ok  " : "FAIL", src, got);
+    failed|=!ok;
+}
+
+int main(void)
+{
+    deep=lval_qexpr();
+    for(int i=0; i<DEPTH; i++)
+    {
+        deep=lval_add(lval_qexpr(), deep);
+    }
+    lctx* c=nisp_new();
+    nisp_register(c, "deep", builtin_deep);
+
+    //Copies come from builtin_deep and def, and are freed after each eval
+    check(c, "== (deep 1) (deep 1)", "1");
+    check(c, "def {x} (deep 1)", "()");
+    check(c, "== x (deep 1)", "1");
+    check(c, "== x {{}}", "0");
+
+    //Printing writes an opening and closing brace per level
+    FILE* out=tmpfile();
+    nisp_output(c, out);
+    check(c, "print x", "()");
+    long size=ftell(out);
+    int ok=(size>=2L*(DEPTH+1));
+    printf("%s printed %ld bytes\n", ok ? "ok  " : "FAIL", size);
+    failed|=!ok;
+    fclose(out);
+
+    nisp_del(c);
+    lval_del(deep);
+    return failed;
+}
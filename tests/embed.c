@@ -0,0 +1,109 @@
+//Embedding test: require a module, reset the context, and call into it
+//again. Build libnisp.a with compile.scr, then from the nisp directory
+//
+//    gcc -std=c99 -I. tests/embed.c libnisp.a -lm -lpthread -o embed && ./embed
+//
+//It prints each check and exits non-zero if any fails.
+
+#include <stdio.h>
+#include <string.h>
+#include "nisp.h"
+
+static int failed=0;
+
+//Times tests/geom.nsp was evaluated
+static int loads=0;
+
+static lval* tick(lenv* e, lval* a)
+{
+    loads++;
+    lval_del(a);
+    return lval_sexpr();
+}
+
+static void report(int ok, char* what, char* got)
+{
+    printf("%s %s => %s\n", ok ? "ok  " : "FAIL", what, got);
+    failed|=!ok;
+}
+
+//Evaluate src and compare the result, written the way the REPL prints
+//the kinds of value the test expects, with want
+static void check(lctx* c, char* src, char* want)
+{
+    char got[256];
+    lval* x=nisp_eval(c, src);
+    switch(x->type)
+    {
+        case LVAL_NUM:
+            snprintf(got, sizeof(got), "%g", x->num);
+            break;
+        case LVAL_ERR:
+            snprintf(got, sizeof(got), "Error: %s", lval_err_msg(x));
+            break;
+        case LVAL_SEXPR:
+            snprintf(got, sizeof(got), x->count ? "(...)" : "()");
+            break;
+        default:
+            snprintf(got, sizeof(got), "<type %d>", x->type);
+            break;
+    }
+    lval_del(x);
+    report(strcmp(got, want)==0, src, got);
+}
+
+static void check_loads(int want)
+{
+    char got[32];
+    snprintf(got, sizeof(got), "%d", loads);
+    report(loads==want, "module evaluations", got);
+}
+
+int main(void)
+{
+    //Required before the snapshot, so it stays loaded across resets and
+    //is not evaluated again
+    lctx* c=nisp_new();
+    nisp_register(c, "tick", tick);
+    lval_del(nisp_load(c, "stdlib.nsp"));
+    check(c, "require \"tests/geom.nsp\"", "()");
+    nisp_snapshot(c);
+    check(c, "geom/square 4", "16");
+    for(int i=0; i<3; i++)
+    {
+        nisp_reset(c);
+        check(c, "geom/area 2 3", "6");
+        check(c, "require \"tests/geom.nsp\" \"g\"", "()");
+        check(c, "g/square 5", "25");
+    }
+    check_loads(1);
+    nisp_del(c);
+
+    //Required after the snapshot, so gone with the reset and evaluated
+    //again by the next require
+    lctx* d=nisp_new();
+    nisp_register(d, "tick", tick);
+    nisp_snapshot(d);
+    check(d, "require \"tests/geom.nsp\"", "()");
+    check_loads(2);
+    nisp_reset(d);
+    check(d, "geom/square 3", "Error: Unbound Symbol 'geom/square'");
+    check(d, "require \"tests/geom.nsp\"", "()");
+    check_loads(3);
+    check(d, "geom/square 3", "9");
+    nisp_del(d);
+
+    //Without a snapshot a reset drops every module, and the builtins
+    //registered since
+    lctx* f=nisp_new();
+    nisp_register(f, "tick", tick);
+    check(f, "require \"tests/geom.nsp\"", "()");
+    check_loads(4);
+    nisp_reset(f);
+    nisp_register(f, "tick", tick);
+    check(f, "require \"tests/geom.nsp\"", "()");
+    check_loads(5);
+    check(f, "geom/area 6 7", "42");
+    nisp_del(f);
+    return failed;
+}